@@ -9,11 +9,104 @@
 #ifndef simple_pushota_h
 #define simple_pushota_h
 
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/** Update request statistics, see CONFIG_SIMPLE_PUSHOTA_STATS. Times are in microseconds. */
+typedef struct {
+	int64_t header_us;		///< receiving and parsing the request headers
+	int64_t begin_us;		///< OTA update setup, including the upfront partition erase if any
+	int64_t recv_us;		///< total time blocked receiving the payload
+	int64_t write_us;		///< total time spent writing to flash
+	int64_t end_us;			///< OTA update finalization, i.e. esp_ota_end()
+	int64_t boot_us;		///< esp_ota_set_boot_partition()
+	int64_t total_us;		///< whole request
+	size_t received;		///< payload bytes received
+	size_t written;			///< image bytes written to flash
+	int min_chunk;			///< smallest amount of payload data returned by a single receive call
+	int max_chunk;			///< largest amount of payload data returned by a single receive call
+	uint32_t rate;			///< average image throughput (bytes/s) over the whole request
+} pushota_stats_t;
+
+/** Push OTA configuration, see PUSHOTA_CONFIG_DEFAULT() */
+typedef struct {
+	void (*conn_cb)(void);		///< optional callback executed when a new connection is made, see pushota()
+	int port;			///< listen port
+	const char *bind_addr;		///< IPv4 address to listen on, NULL or "" for any
+	int backlog;			///< listen backlog
+	int rcvbuf;			///< receive buffer size (SO_RCVBUF), 0 for lwIP default
+	int rcv_timeout;		///< receive timeout (s), 0 for none
+	int keepalive_idle;		///< delay (s) before starting sending keepalives, 0 to disable keepalives
+	int keepalive_interval;		///< keepalive probes period (s)
+	int keepalive_count;		///< max unanswered keepalive probes before timeout
+	pushota_stats_t *stats;		///< optional, filled with the statistics of the last update request (if enabled)
+	void (*begin_cb)(void *arg, size_t total);			///< optional, called when the update begins (total is 0 if unknown)
+	void (*progress_cb)(void *arg, size_t written, size_t total);	///< optional, called as the image is written (total is 0 if unknown)
+	void (*end_cb)(void *arg);					///< optional, called when the update has succeeded
+	void (*fail_cb)(void *arg, esp_err_t err);			///< optional, called when the update has failed after it began
+	void *cb_arg;			///< argument passed to the above callbacks
+	size_t progress_bytes;		///< call progress_cb whenever this much data has been written since the last call, 0 to ignore
+	uint32_t progress_ms;		///< call progress_cb whenever this much time (ms) has elapsed since the last call, 0 to ignore
+} pushota_config_t;
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_ENABLED
+/** Default configuration, from menuconfig */
+#define PUSHOTA_CONFIG_DEFAULT() {					\
+	.conn_cb = NULL,						\
+	.port = CONFIG_SIMPLE_PUSHOTA_PORT,				\
+	.bind_addr = CONFIG_SIMPLE_PUSHOTA_BIND_ADDR,			\
+	.backlog = CONFIG_SIMPLE_PUSHOTA_BACKLOG,			\
+	.rcvbuf = CONFIG_SIMPLE_PUSHOTA_RCVBUF,				\
+	.rcv_timeout = CONFIG_SIMPLE_PUSHOTA_RCV_TIMEOUT,		\
+	.keepalive_idle = CONFIG_SIMPLE_PUSHOTA_KEEPALIVE_IDLE,		\
+	.keepalive_interval = CONFIG_SIMPLE_PUSHOTA_KEEPALIVE_INTERVAL,	\
+	.keepalive_count = CONFIG_SIMPLE_PUSHOTA_KEEPALIVE_COUNT,	\
+	.stats = NULL,							\
+	.begin_cb = NULL,						\
+	.progress_cb = NULL,						\
+	.end_cb = NULL,							\
+	.fail_cb = NULL,						\
+	.cb_arg = NULL,							\
+	.progress_bytes = 64 * 1024,					\
+	.progress_ms = 1000,						\
+}
+#else
+/** Default configuration, with the menuconfig defaults (the component is disabled) */
+#define PUSHOTA_CONFIG_DEFAULT() {					\
+	.conn_cb = NULL,						\
+	.port = 8888,							\
+	.bind_addr = "",						\
+	.backlog = 1,							\
+	.rcvbuf = 0,							\
+	.rcv_timeout = 0,						\
+	.keepalive_idle = 5,						\
+	.keepalive_interval = 5,					\
+	.keepalive_count = 3,						\
+	.stats = NULL,							\
+	.begin_cb = NULL,						\
+	.progress_cb = NULL,						\
+	.end_cb = NULL,							\
+	.fail_cb = NULL,						\
+	.cb_arg = NULL,							\
+	.progress_bytes = 64 * 1024,					\
+	.progress_ms = 1000,						\
+}
+#endif
+
 esp_err_t pushota(void (*conn_cb)(void));
+esp_err_t pushota_ex(const pushota_config_t *cfg);
+esp_err_t pushota_multicast(const pushota_config_t *cfg);
+esp_err_t pushota_erase_start(void);
+esp_err_t pushota_fanout(const char *const *peers, int npeers, const pushota_config_t *cfg);
+esp_err_t pushota_server_start(const pushota_config_t *cfg);
+int pushota_server_fd(void);
+esp_err_t pushota_server_poll(const pushota_config_t *cfg);
+void pushota_server_stop(void);
 
 #ifdef __cplusplus
 }
@@ -26,200 +26,4910 @@
  * To query the current firmware version, if CONFIG_SIMPLE_PUSHOTA_GETVERSION is defined, send a "GET" request using e.g. `curl <esphost>:OTA_PORT`
  */
 
+#include <limits.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#if defined(CONFIG_SIMPLE_PUSHOTA_PIPELINE) || defined(CONFIG_SIMPLE_PUSHOTA_PARALLEL) || defined(CONFIG_SIMPLE_PUSHOTA_BG_ERASE)
+ #include "freertos/semphr.h"
+#endif
 #include "esp_system.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
 #include "esp_ota_ops.h"
+#include "esp_timer.h"
+
+#include "simple_pushota.h"
+
+#include "lwip/err.h"
+#include "lwip/sockets.h"
+#include "lwip/sys.h"
+#include "lwip/netdb.h"
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_NET_NETCONN
+ #include "lwip/api.h"
+ #include "lwip/tcp.h"
+ #include "lwip/tcpip.h"
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_INFLATE
+ #include "rom/miniz.h"
+ #include "esp_rom_crc.h"
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHECK_IMAGE
+ #include "esp_app_format.h"
+#endif
+
+#if defined(CONFIG_SIMPLE_PUSHOTA_RESUME) || defined(CONFIG_SIMPLE_PUSHOTA_BG_ERASE)
+ #include "nvs.h"
+#endif
+
+#if defined(CONFIG_SIMPLE_PUSHOTA_RESUME) || defined(CONFIG_SIMPLE_PUSHOTA_DIGEST)
+ #include "mbedtls/sha256.h"
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_DIGEST
+ #include "mbedtls/base64.h"
+#endif
+
+#if defined(CONFIG_SIMPLE_PUSHOTA_MULTICAST) && !defined(CONFIG_IDF_TARGET_ESP8266)
+ #include "esp_random.h"
+#endif
+
+#define OTA_BUFSIZE		CONFIG_SIMPLE_PUSHOTA_BUFSIZE
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_BUF_PSRAM
+ #define OTA_MALLOC_CAPS	(MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+#else
+ #define OTA_MALLOC_CAPS	(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#endif
+
+#define HTTP_IDLE_TIMEOUT	5	// delay (s) to wait for a subsequent request on a persistent connection
+#define OTA_POLL_WAIT		1	// accept timeout (ms) of pushota_server_poll(), lwIP has no zero timeout
+#define OTA_AGAIN		(-2)	// ota_recv() return value when no data is available yet on a non-blocking connection
+
+#define OTA_SECTOR_SIZE		4096	// flash erase unit
+
+#if defined(CONFIG_SIMPLE_PUSHOTA_GETVERSION) || defined(CONFIG_SIMPLE_PUSHOTA_INFLATE) || \
+    defined(CONFIG_SIMPLE_PUSHOTA_RESUME) || defined(CONFIG_SIMPLE_PUSHOTA_DIGEST) || defined(CONFIG_SIMPLE_PUSHOTA_PARALLEL) || \
+    defined(CONFIG_SIMPLE_PUSHOTA_ETAG)
+ #define OTA_HDR_LOOKUP		// request headers other than Content-Length and Transfer-Encoding are kept by the parser
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_NET_NETCONN
+ typedef struct netconn * ota_listener_t;
+ #define OTA_NO_LISTENER	NULL
+ #if !defined(CONFIG_SIMPLE_PUSHOTA_COALESCE) && !defined(CONFIG_SIMPLE_PUSHOTA_PIPELINE)
+  #define OTA_ZEROCOPY		// received data is written to flash straight from lwIP buffers
+ #endif
+#else
+ typedef int ota_listener_t;
+ #define OTA_NO_LISTENER	-1
+#endif
+
+// BUFSIZE defaults to 4096 with coalescing, this catches explicit settings
+#if defined(CONFIG_SIMPLE_PUSHOTA_SKIP_UNCHANGED) && (OTA_BUFSIZE % OTA_SECTOR_SIZE)
+ #error "CONFIG_SIMPLE_PUSHOTA_BUFSIZE must be a multiple of the flash sector size to skip unchanged sectors"
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHECK_IMAGE
+ // image data needed by ota_wr_check(): image header, first segment header and application description
+ #define OTA_CHECK_LEN		(sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t))
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_RESUME
+ #define RESUME_NVS_NAMESPACE	"pushota"
+ #define RESUME_NVS_KEY		"resume"
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_MULTICAST
+ #define MCAST_MAGIC		0x504f5441	// "POTA"
+ #define MCAST_HDRLEN		20
+ #define MCAST_BLKALIGN		16	// block size alignment, so that block offsets suit encrypted flash writes
+ #define MCAST_MAX_RANGES	32	// missing block ranges reported per NACK
+ #define MCAST_NACK_SPREAD	200	// max random delay (ms) before sending a NACK, to spread the load on the sender
+ #define MCAST_TIMEOUT		30	// delay (s) without packets before giving up on a started session, unless rcv_timeout is set
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PREPARE
+ #ifndef CONFIG_SIMPLE_PUSHOTA_BUF_STACK
+  #define OTA_PREP_BUF		// the receive buffer is reserved in advance
+ #endif
+ #if defined(CONFIG_SIMPLE_PUSHOTA_PARTWRITE) && CONFIG_SIMPLE_PUSHOTA_PREPARE_ERASE > 0
+  #define OTA_PREP_ERASE	(CONFIG_SIMPLE_PUSHOTA_PREPARE_ERASE * OTA_SECTOR_SIZE)
+ #endif
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_BG_ERASE
+ #define CLEAN_NVS_NAMESPACE	"pushota"
+ #define CLEAN_NVS_KEY		"clean"
+ #define OTA_BG_SLICE		(CONFIG_SIMPLE_PUSHOTA_BG_ERASE_SLICE * OTA_SECTOR_SIZE)
+ #define OTA_BG_STACK		3072
+#endif
+
+#if defined(OTA_PREP_ERASE) || defined(CONFIG_SIMPLE_PUSHOTA_BG_ERASE)
+ #define OTA_CLEAN		// the target partition may be erased ahead of the update
+ #if defined(CONFIG_SIMPLE_PUSHOTA_BG_ERASE) || defined(CONFIG_SIMPLE_PUSHOTA_PARALLEL)
+  #define OTA_CLEAN_LOCK	// the erased area is shared with other tasks
+ #endif
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+ #define OTA_PAR_CONNS		CONFIG_SIMPLE_PUSHOTA_PARALLEL_CONNS
+ #ifdef CONFIG_SIMPLE_PUSHOTA_BUF_STACK
+  #define OTA_PAR_STACK		(CONFIG_SIMPLE_PUSHOTA_PARALLEL_STACK + OTA_BUFSIZE)
+ #else
+  #define OTA_PAR_STACK		CONFIG_SIMPLE_PUSHOTA_PARALLEL_STACK
+ #endif
+ #define OTA_PAR_POLL		1000	// accept timeout (ms) while serving parallel connections
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PIPELINE
+ #define OTA_PIPE_NBUFS		CONFIG_SIMPLE_PUSHOTA_PIPELINE_NBUFS
+ #define OTA_PIPE_STACK		CONFIG_SIMPLE_PUSHOTA_PIPELINE_STACK
+ #if CONFIG_SIMPLE_PUSHOTA_PIPELINE_WRITER_PRIO
+  #define OTA_PIPE_PRIO		CONFIG_SIMPLE_PUSHOTA_PIPELINE_WRITER_PRIO
+ #else
+  #define OTA_PIPE_PRIO		uxTaskPriorityGet(NULL)
+ #endif
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PIPELINE_AFFINITY
+ // receive on the lwIP core (core 0 if lwIP isn't pinned), write flash on the other one
+ #if CONFIG_LWIP_TCPIP_TASK_AFFINITY == 1
+  #define OTA_NET_CORE		1
+ #else
+  #define OTA_NET_CORE		0
+ #endif
+ #define OTA_PIPE_CORE		(1 - OTA_NET_CORE)
+#else
+ #define OTA_NET_CORE		tskNO_AFFINITY
+ #define OTA_PIPE_CORE		tskNO_AFFINITY
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_EXPORT
+ #define OTA_EXPORT_BLK		0x10000	// partition export block, mapped at once
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_FANOUT
+ #define OTA_FANOUT_TIMEOUT	CONFIG_SIMPLE_PUSHOTA_FANOUT_TIMEOUT	// peer timeout (s), unless cfg->rcv_timeout is set
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_ETAG
+ #define OTA_ETAG_SIZE		(2 * 32 + 3)	// quoted hex ELF SHA-256
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_THROTTLE
+ #define OTA_THR_RATE		(CONFIG_SIMPLE_PUSHOTA_THROTTLE_RATE * 1024)	// bytes/s, 0 for no limit
+ #define OTA_THR_FLASH_MS	CONFIG_SIMPLE_PUSHOTA_THROTTLE_FLASH_MS	// 0 for no limit
+ #define OTA_THR_WINDOW_MS	CONFIG_SIMPLE_PUSHOTA_THROTTLE_WINDOW
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_BOOST_PRIO
+ #define OTA_BOOST_PRIO		CONFIG_SIMPLE_PUSHOTA_BOOST_PRIO
+#else
+ #define OTA_BOOST_PRIO		0
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_ENABLED
+static const char * TAG = "pushota";
+
+/** Flash write context */
+struct ota_wctx {
+	const esp_partition_t *part;	///< target partition
+	size_t imglen;			///< image size, or OTA_SIZE_UNKNOWN
+	bool begun;			///< true once the update is setup
+	bool notified;			///< true once the begin callback has been called
+	const pushota_config_t *cfg;	///< configuration, for callbacks
+	size_t done;			///< amount of image data handed over to flash
+	size_t last_done;		///< value of done at the last progress callback
+	TickType_t last_tick;		///< time of the last progress callback
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARTWRITE
+	size_t start;			///< partition offset of the first image byte received (sector aligned, when resuming)
+	size_t offset;			///< current write offset in the partition
+	size_t erased;			///< flash is erased from offset up to this (sector aligned) offset
+	int skipped;			///< number of unchanged sectors
+#else
+	esp_ota_handle_t handle;
+#endif
+	char *buf;			///< current write buffer, OTA_BUFSIZE long
+	int fill;			///< amount of data in the current write buffer
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	pushota_stats_t st;		///< request statistics
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_DIGEST
+	bool digest;			///< true if the image is hashed
+	mbedtls_sha256_context sha;	///< image hash context
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_PIPELINE
+	QueueHandle_t freeq, fullq;	///< buffers available for receive / pending flash write
+	SemaphoreHandle_t exited;	///< given by the writer task when it exits
+	volatile esp_err_t err;		///< first error reported by the writer task
+	char *pool;			///< OTA_PIPE_NBUFS * OTA_BUFSIZE buffer pool
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_THROTTLE
+	int64_t thr_next;		///< time (us) before which the next flash write should not start
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHECK_IMAGE
+	const char *reject;		///< HTTP status if the image was refused by ota_wr_check()
+#endif
+};
+
+struct ota_inflate;
+struct ota_delta;
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHUNKED
+/** Chunked transfer-coding decoder states */
+enum {
+	CHUNK_NONE,	///< body is not chunked
+	CHUNK_SIZE,	///< chunk size
+	CHUNK_EXT,	///< chunk extension, ignored
+	CHUNK_DATA,	///< chunk data
+	CHUNK_CRLF,	///< line terminator after chunk data
+	CHUNK_TRAILER,	///< trailer section, ignored
+	CHUNK_DONE,	///< end of body
+};
+
+/** Chunked transfer-coding decoder */
+struct ota_chunked {
+	int state;
+	size_t left;			///< chunk size being parsed, then chunk data left
+	bool digits;			///< true once a chunk size digit has been parsed
+	bool field;			///< true if the current trailer line is not empty
+	bool cr;			///< true after a CR, which must end the line
+};
+#endif
+
+/** Request body processing context */
+struct ota_body {
+	struct ota_wctx w;		///< flash write context
+	struct ota_inflate *z;		///< decompression context, or NULL
+	struct ota_delta *d;		///< patch context, or NULL
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHUNKED
+	struct ota_chunked k;		///< transfer-coding decoder
+#endif
+};
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PREPARE
+/** Resources reserved while waiting for a connection, see ota_prepare() */
+static struct {
+	const esp_partition_t *part;	///< target partition, NULL until resolved
+#ifdef OTA_PREP_BUF
+	char *buf;			///< receive buffer, or NULL
+#endif
+} ota_prep;
+#endif
+
+#ifdef OTA_CLEAN
+/** Target partition area erased ahead of the update */
+static struct {
+	const esp_partition_t *part;	///< partition, NULL if none
+	size_t size;			///< the partition is erased from its start up to this offset
+#ifdef OTA_CLEAN_LOCK
+	SemaphoreHandle_t lock;		///< protects this structure, the session lock with parallel uploads, NULL until created
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_BG_ERASE
+	TaskHandle_t task;		///< background erase task, NULL if not running
+	bool cleared;			///< true once the NVS record is known to be clear
+#endif
+} ota_clean;
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_BG_ERASE
+/** Erased partition record, saved in NVS */
+struct ota_clean_rec {
+	char label[sizeof(((esp_partition_t *)0)->label)];	///< erased partition label
+	uint32_t size;			///< erased partition size
+};
+
+/**
+ * Save or clear the erased partition record in NVS. Must be called with the lock held.
+ * Clearing is skipped once the record is known to be clear, so that NVS is only written when the record changes.
+ * @param part the fully erased partition, NULL to clear the record
+ * @return execution status
+ */
+static esp_err_t ota_clean_store(const esp_partition_t *part)
+{
+	struct ota_clean_rec rec = { 0 };
+	nvs_handle_t nvs;
+	esp_err_t ret;
+
+	if (!part && ota_clean.cleared)
+		return ESP_OK;
+
+	ret = nvs_open(CLEAN_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+	if (ret != ESP_OK)
+		return ret;
+
+	if (part) {
+		strncpy(rec.label, part->label, sizeof(rec.label) - 1);
+		rec.size = part->size;
+		ret = nvs_set_blob(nvs, CLEAN_NVS_KEY, &rec, sizeof(rec));
+	}
+	else {
+		ret = nvs_erase_key(nvs, CLEAN_NVS_KEY);
+		if (ret == ESP_ERR_NVS_NOT_FOUND) {
+			nvs_close(nvs);
+			ota_clean.cleared = true;
+			return ESP_OK;	// nothing to commit
+		}
+	}
+	if (ret == ESP_OK)
+		ret = nvs_commit(nvs);
+	nvs_close(nvs);
+
+	if (ret == ESP_OK)
+		ota_clean.cleared = !part;
+
+	return ret;
+}
+
+/**
+ * Check the NVS record of a previous background erase.
+ * @param part the partition
+ * @return true if the partition was fully erased and has not been written to since, as far as we can tell
+ */
+static bool ota_clean_load(const esp_partition_t *part)
+{
+	struct ota_clean_rec rec;
+	size_t len = sizeof(rec);
+	uint32_t head[8];
+	nvs_handle_t nvs;
+	esp_err_t ret;
+	int i;
+
+	if (nvs_open(CLEAN_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+		return false;
+	ret = nvs_get_blob(nvs, CLEAN_NVS_KEY, &rec, &len);
+	nvs_close(nvs);
+
+	if (ret != ESP_OK || len != sizeof(rec) || strncmp(rec.label, part->label, sizeof(rec.label)) || rec.size != part->size)
+		return false;
+
+	// cheap sanity check, any image starts with a non-blank header
+	if (esp_partition_read(part, 0, head, sizeof(head)) != ESP_OK)
+		return false;
+	for (i = 0; i < sizeof(head)/sizeof(head[0]); i++) {
+		if (head[i] != UINT32_MAX)
+			return false;
+	}
+
+	return true;
+}
+#endif /* CONFIG_SIMPLE_PUSHOTA_BG_ERASE */
+
+/**
+ * Claim the area erased ahead of the update, before writing to a partition.
+ * That area is only known to be erased until the partition is first written to: it is forgotten here,
+ * and any background erase of the partition stops after its current slice.
+ * @param part the partition about to be written to
+ * @param erased if not NULL, will be set to the end of the erased area if it covers the start of the partition
+ */
+static void ota_clean_take(const esp_partition_t *part, size_t *erased)
+{
+#ifdef OTA_CLEAN_LOCK
+	if (ota_clean.lock)
+		xSemaphoreTake(ota_clean.lock, portMAX_DELAY);
+#endif
+	if (part == ota_clean.part) {
+		if (erased)
+			*erased = ota_clean.size;
+		ota_clean.part = NULL;
+		ota_clean.size = 0;
+	}
+#ifdef CONFIG_SIMPLE_PUSHOTA_BG_ERASE
+	ota_clean_store(NULL);	// the record may date from a previous boot
+#endif
+#ifdef OTA_CLEAN_LOCK
+	if (ota_clean.lock)
+		xSemaphoreGive(ota_clean.lock);
+#endif
+}
+#endif /* OTA_CLEAN */
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_SKIP_UNCHANGED
+/**
+ * Compare data with the current partition content.
+ * @param w the write context
+ * @param offset the partition offset
+ * @param data the data to compare
+ * @param len the data length
+ * @return true if the partition already holds this data
+ */
+static bool ota_part_same(struct ota_wctx *w, size_t offset, const char *data, int len)
+{
+	char cmp[256];
+	int n;
+
+	for (; len; len -= n, offset += n, data += n) {
+		n = (len < sizeof(cmp)) ? len : sizeof(cmp);
+		if (esp_partition_read(w->part, offset, cmp, n) != ESP_OK || memcmp(cmp, data, n))
+			return false;
+	}
+
+	return true;
+}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARTWRITE
+/**
+ * Write data at the current offset of the target partition, through the partition API.
+ * Sectors are erased just before they are first written to.
+ * With CONFIG_SIMPLE_PUSHOTA_SKIP_UNCHANGED, writes are sector aligned (see ota_wr_put()) and
+ * sectors which already hold the incoming data are neither erased nor written.
+ * @param w the write context
+ * @param data the data to write
+ * @param len the data length
+ * @return execution status
+ */
+static esp_err_t ota_part_write(struct ota_wctx *w, const char *data, int len)
+{
+	esp_err_t ret;
+	size_t end;
+	int n;
+
+	if (w->offset + len > w->part->size)
+		return ESP_ERR_INVALID_SIZE;
+
+	for (; len; len -= n, data += n, w->offset += n) {
+		end = (w->offset + OTA_SECTOR_SIZE) & ~(OTA_SECTOR_SIZE - 1);
+		n = (len < end - w->offset) ? len : end - w->offset;
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_SKIP_UNCHANGED
+		if (ota_part_same(w, w->offset, data, n)) {
+			w->skipped++;
+			continue;
+		}
+#endif
+		if (w->offset >= w->erased) {
+			ret = esp_partition_erase_range(w->part, end - OTA_SECTOR_SIZE, OTA_SECTOR_SIZE);
+			if (ret != ESP_OK)
+				return ret;
+			w->erased = end;
+		}
+
+		ret = esp_partition_write(w->part, w->offset, data, n);
+		if (ret != ESP_OK)
+			return ret;
+	}
+
+	return ESP_OK;
+}
+#endif
+
+#if defined(CONFIG_SIMPLE_PUSHOTA_MULTICAST) || defined(CONFIG_SIMPLE_PUSHOTA_PARALLEL)
+/** Image block completion map, for out-of-order writes */
+struct ota_blkmap {
+	uint32_t *bits;			///< one bit per block, set once written
+	size_t nblocks;			///< number of blocks in the image
+	size_t missing;			///< number of blocks not written yet
+};
+
+/**
+ * Setup a block map.
+ * @param m the block map
+ * @param nblocks the number of blocks in the image
+ * @return execution status
+ */
+static esp_err_t ota_blkmap_init(struct ota_blkmap *m, size_t nblocks)
+{
+	size_t size = (nblocks + 31) / 32 * sizeof(*m->bits);
+
+	m->bits = heap_caps_malloc(size, OTA_MALLOC_CAPS);
+	if (!m->bits)
+		return ESP_ERR_NO_MEM;
+
+	memset(m->bits, 0, size);
+	m->nblocks = m->missing = nblocks;
+
+	return ESP_OK;
+}
+
+/**
+ * Check whether a block has been written.
+ * @param m the block map
+ * @param n the block number, less than m->nblocks
+ * @return true if the block has been written
+ */
+static bool ota_blkmap_get(const struct ota_blkmap *m, size_t n)
+{
+	return m->bits[n / 32] & (1U << (n % 32));
+}
+
+/**
+ * Mark a block as written.
+ * @param m the block map
+ * @param n the block number, less than m->nblocks
+ */
+static void ota_blkmap_set(struct ota_blkmap *m, size_t n)
+{
+	if (ota_blkmap_get(m, n))
+		return;
+
+	m->bits[n / 32] |= 1U << (n % 32);
+	m->missing--;
+}
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+/**
+ * Mark a block as not written.
+ * @param m the block map
+ * @param n the block number, less than m->nblocks
+ */
+static void ota_blkmap_clear(struct ota_blkmap *m, size_t n)
+{
+	if (!ota_blkmap_get(m, n))
+		return;
+
+	m->bits[n / 32] &= ~(1U << (n % 32));
+	m->missing++;
+}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_MULTICAST
+/**
+ * Find the next range of missing blocks.
+ * @param m the block map
+ * @param from the block number to start searching from
+ * @param count will be set to the number of consecutive missing blocks found
+ * @return the first missing block at or after from, m->nblocks if none
+ */
+static size_t ota_blkmap_next(const struct ota_blkmap *m, size_t from, size_t *count)
+{
+	size_t n;
+
+	while (from < m->nblocks && ota_blkmap_get(m, from))
+		from++;
+	for (n = from; n < m->nblocks && !ota_blkmap_get(m, n); n++)
+		;
+
+	*count = n - from;
+	return from;
+}
+#endif
+#endif
+
+#if defined(CONFIG_SIMPLE_PUSHOTA_RESUME) || (defined(CONFIG_SIMPLE_PUSHOTA_FANOUT) && defined(CONFIG_SIMPLE_PUSHOTA_DIGEST))
+/**
+ * Hash the beginning of a partition.
+ * @param ctx the hash context to update
+ * @param part the partition
+ * @param len the amount of data to hash
+ * @return execution status
+ */
+static esp_err_t ota_part_sha256(mbedtls_sha256_context *ctx, const esp_partition_t *part, size_t len)
+{
+	uint8_t tmp[256];
+	esp_err_t ret;
+	size_t off, n;
+
+	for (off = 0; off < len; off += n) {
+		n = (len - off < sizeof(tmp)) ? len - off : sizeof(tmp);
+		ret = esp_partition_read(part, off, tmp, n);
+		if (ret != ESP_OK)
+			return ret;
+		mbedtls_sha256_update(ctx, tmp, n);
+	}
+
+	return ESP_OK;
+}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_THROTTLE
+/**
+ * Hold the caller back after a flash write, to keep the write rate and the share of time spent
+ * writing to flash (during which the cache is disabled) within the configured limits.
+ * Each write pushes the earliest start of the next one back by the larger of its rate and flash time costs,
+ * the caller only sleeps once that amounts to at least a tick.
+ * @param w the write context
+ * @param start time (us) the write started
+ * @param len the amount of data written
+ */
+static void ota_wr_throttle(struct ota_wctx *w, int64_t start, int len)
+{
+	int64_t now = esp_timer_get_time(), cost = 0, t;
+	TickType_t ticks;
+
+#if OTA_THR_RATE
+	cost = (int64_t)len * 1000000 / OTA_THR_RATE;
+#endif
+#if OTA_THR_FLASH_MS
+	// flash time is only granted OTA_THR_FLASH_MS of every OTA_THR_WINDOW_MS
+	t = (now - start) * OTA_THR_WINDOW_MS / OTA_THR_FLASH_MS;
+	if (t > cost)
+		cost = t;
+#endif
+
+	if (w->thr_next < start)
+		w->thr_next = start;
+	w->thr_next += cost;
+
+	t = w->thr_next - now;
+	ticks = (t > 0) ? t / (portTICK_PERIOD_MS * 1000) : 0;
+	if (ticks)
+		vTaskDelay(ticks);
+}
+#endif
+
+/**
+ * Write data to flash.
+ * @param w the write context
+ * @param data the data to write
+ * @param len the data length
+ * @return execution status
+ */
+static esp_err_t ota_wr_flash(struct ota_wctx *w, const char *data, int len)
+{
+	esp_err_t ret;
+#if defined(CONFIG_SIMPLE_PUSHOTA_STATS) || defined(CONFIG_SIMPLE_PUSHOTA_THROTTLE)
+	int64_t start = esp_timer_get_time();
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARTWRITE
+	ret = ota_part_write(w, data, len);
+#else
+	ret = esp_ota_write(w->handle, data, len);
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	w->st.write_us += esp_timer_get_time() - start;
+	w->st.written += len;
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_THROTTLE
+	if (ret == ESP_OK)
+		ota_wr_throttle(w, start, len);
+#endif
+	return ret;
+}
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PIPELINE
+/** Pipeline buffer descriptor. A NULL data pointer tells the writer to exit. */
+struct ota_chunk {
+	char *data;
+	int len;
+};
+
+/**
+ * Flash writer task.
+ * Drain the full queue to flash and hand buffers back to the receiver.
+ * After the first error, buffers are recycled without being written.
+ * @param arg the write context
+ */
+static void ota_writer(void *arg)
+{
+	struct ota_wctx *w = arg;
+	struct ota_chunk chunk;
+
+	while (xQueueReceive(w->fullq, &chunk, portMAX_DELAY) == pdTRUE && chunk.data) {
+		if (w->err == ESP_OK)
+			w->err = ota_wr_flash(w, chunk.data, chunk.len);
+		xQueueSend(w->freeq, &chunk, portMAX_DELAY);
+	}
+
+	// not a task notification: the receiving task may be any application task, using its own
+	xSemaphoreGive(w->exited);
+	vTaskDelete(NULL);
+}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHECK_VERSION
+/**
+ * Compare version strings, numeric parts numerically (e.g. "1.10" > "1.9").
+ * @param a first version
+ * @param b second version
+ * @return <0, 0 or >0 if a is older than, the same as or newer than b
+ */
+static int ota_vercmp(const char *a, const char *b)
+{
+	unsigned long x, y;
+
+	while (*a && *b) {
+		if (*a >= '0' && *a <= '9' && *b >= '0' && *b <= '9') {
+			for (x = 0; *a >= '0' && *a <= '9'; a++)
+				x = x * 10 + (*a - '0');
+			for (y = 0; *b >= '0' && *b <= '9'; b++)
+				y = y * 10 + (*b - '0');
+			if (x != y)
+				return (x < y) ? -1 : 1;
+		}
+		else if (*a != *b)
+			break;
+		else {
+			a++;
+			b++;
+		}
+	}
+
+	return (unsigned char)*a - (unsigned char)*b;
+}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHECK_IMAGE
+/**
+ * Check the image header and application description against the running firmware, before the update is setup.
+ * Only done once, if the data is the start of the image, which is refused if too short to hold both
+ * (see ota_wr_hold()).
+ * @param w the write context
+ * @param data the first image data, possibly unaligned
+ * @param len the amount of image data
+ * @return execution status, w->reject is set if the image is refused
+ */
+static esp_err_t ota_wr_check(struct ota_wctx *w, const char *data, int len)
+{
+	const esp_app_desc_t *run = esp_app_get_description();
+	const esp_image_header_t *hdr = (const void *)data;
+	const char *d = data + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t);	// esp_app_desc_t
+	char ver[sizeof(run->version) + 1];
+	uint32_t magic;
+
+	if (w->begun)
+		return ESP_OK;
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARTWRITE
+	if (w->start)	// not the start of the image
+		return ESP_OK;
+#endif
+	if (len < OTA_CHECK_LEN) {
+		ESP_LOGE(TAG, "Image too short");
+		goto conflict;
+	}
+
+	memcpy(&magic, d + offsetof(esp_app_desc_t, magic_word), sizeof(magic));
+	if (hdr->magic != ESP_IMAGE_HEADER_MAGIC || magic != ESP_APP_DESC_MAGIC_WORD) {
+		ESP_LOGE(TAG, "Not an app image");
+		goto conflict;
+	}
+
+	if (hdr->chip_id != CONFIG_IDF_FIRMWARE_CHIP_ID) {
+		ESP_LOGE(TAG, "Image for chip id %d", hdr->chip_id);
+		goto conflict;
+	}
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHECK_PROJECT
+	if (strncmp(d + offsetof(esp_app_desc_t, project_name), run->project_name, sizeof(run->project_name))) {
+		ESP_LOGE(TAG, "Image for project %.*s", (int)sizeof(run->project_name), d + offsetof(esp_app_desc_t, project_name));
+		goto conflict;
+	}
+#endif
+
+	memcpy(ver, d + offsetof(esp_app_desc_t, version), sizeof(run->version));
+	ver[sizeof(run->version)] = '\0';
+	ESP_LOGI(TAG, "Image version: %s", ver);
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHECK_VERSION
+	if (ota_vercmp(ver, run->version) <= 0) {
+		ESP_LOGE(TAG, "Image not newer than running version %s", run->version);
+		w->reject = "412 Precondition Failed";
+		return ESP_ERR_INVALID_VERSION;
+	}
+#endif
+
+	return ESP_OK;
+
+conflict:
+	w->reject = "409 Conflict";
+	return ESP_ERR_OTA_VALIDATE_FAILED;
+}
+
+/**
+ * Tell whether the start of the image must be held in the write buffer,
+ * until long enough to be checked by ota_wr_check().
+ * @param w the write context
+ * @return true if the buffered data must not be committed yet
+ */
+static bool ota_wr_hold(const struct ota_wctx *w)
+{
+	return !w->begun && w->fill < OTA_CHECK_LEN
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARTWRITE
+	    && !w->start
+#endif
+	    ;
+}
+#endif
+
+/**
+ * Setup the OTA update, if not already done.
+ * This is deferred until the first flash write, at which point the image size is known.
+ * @param w the write context
+ * @return execution status
+ */
+static esp_err_t ota_wr_begin(struct ota_wctx *w)
+{
+	esp_err_t ret;
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	int64_t start = esp_timer_get_time();
+#endif
+
+	if (w->begun)
+		return ESP_OK;
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARTWRITE
+	ret = (w->imglen == OTA_SIZE_UNKNOWN || w->imglen <= w->part->size) ? ESP_OK : ESP_ERR_INVALID_SIZE;
+	w->offset = w->erased = w->start;
+	w->skipped = 0;
+#ifdef OTA_CLEAN
+	ota_clean_take(w->part, w->start ? NULL : &w->erased);
+#endif
+#elif defined(CONFIG_SIMPLE_PUSHOTA_LAZY_ERASE)
+	// erase sectors as they are written
+	ret = esp_ota_begin(w->part, OTA_WITH_SEQUENTIAL_WRITES, &w->handle);
+#else
+	ret = esp_ota_begin(w->part, w->imglen, &w->handle);
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	w->st.begin_us = esp_timer_get_time() - start;
+#endif
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "OTA begin: %s", esp_err_to_name(ret));
+		return ret;
+	}
+
+	w->begun = true;
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARTWRITE
+	w->done = w->last_done = w->start;
+#else
+	w->done = w->last_done = 0;
+#endif
+	w->last_tick = xTaskGetTickCount();
+
+	if (w->cfg->begin_cb && !w->notified)
+		w->cfg->begin_cb(w->cfg->cb_arg, (w->imglen == OTA_SIZE_UNKNOWN) ? 0 : w->imglen);
+	w->notified = true;
+
+	return ESP_OK;
+}
+
+/**
+ * Account for image data handed over to flash, and call the progress callback if due.
+ * @param w the write context
+ * @param len the amount of image data
+ */
+static void ota_wr_progress(struct ota_wctx *w, int len)
+{
+	const pushota_config_t *cfg = w->cfg;
+	TickType_t now;
+
+	w->done += len;
+	if (!cfg->progress_cb)
+		return;
+
+	// throttle, except for the last call
+	now = xTaskGetTickCount();
+	if ((cfg->progress_bytes || cfg->progress_ms) && w->done != w->imglen &&
+	    !(cfg->progress_bytes && w->done - w->last_done >= cfg->progress_bytes) &&
+	    !(cfg->progress_ms && now - w->last_tick >= pdMS_TO_TICKS(cfg->progress_ms)))
+		return;
+
+	w->last_done = w->done;
+	w->last_tick = now;
+	cfg->progress_cb(cfg->cb_arg, w->done, (w->imglen == OTA_SIZE_UNKNOWN) ? 0 : w->imglen);
+}
+
+/**
+ * Start the flash write path.
+ * @param w the write context
+ * @param buf the default (non-pipelined) write buffer
+ * @return execution status
+ */
+static esp_err_t ota_wr_start(struct ota_wctx *w, char *buf)
+{
+#ifdef CONFIG_SIMPLE_PUSHOTA_PIPELINE
+	struct ota_chunk chunk = { .len = 0 };
+	int i;
+
+	w->err = ESP_OK;
+	w->exited = xSemaphoreCreateBinary();
+	w->pool = heap_caps_malloc(OTA_PIPE_NBUFS * OTA_BUFSIZE, OTA_MALLOC_CAPS);
+	w->freeq = xQueueCreate(OTA_PIPE_NBUFS, sizeof(chunk));
+	w->fullq = xQueueCreate(OTA_PIPE_NBUFS + 1, sizeof(chunk));	// room for the exit request
+	if (!w->exited || !w->pool || !w->freeq || !w->fullq) {
+		ESP_LOGE(TAG, "Out of memory for pipeline");
+		goto fail;
+	}
+
+	for (i = 0; i < OTA_PIPE_NBUFS; i++) {
+		chunk.data = w->pool + i * OTA_BUFSIZE;
+		xQueueSend(w->freeq, &chunk, 0);
+	}
+
+	if (xTaskCreatePinnedToCore(ota_writer, "ota_writer", OTA_PIPE_STACK, w, OTA_PIPE_PRIO, NULL, OTA_PIPE_CORE) != pdPASS) {
+		ESP_LOGE(TAG, "Failed to create writer task");
+		goto fail;
+	}
+
+	return ESP_OK;
+
+fail:
+	if (w->fullq)
+		vQueueDelete(w->fullq);
+	if (w->freeq)
+		vQueueDelete(w->freeq);
+	if (w->exited)
+		vSemaphoreDelete(w->exited);
+	heap_caps_free(w->pool);
+	w->fullq = w->freeq = NULL;
+	w->exited = NULL;
+	w->pool = NULL;
+	return ESP_ERR_NO_MEM;
+#else
+	w->buf = buf;
+	return ESP_OK;
+#endif
+}
+
+/**
+ * Hand the current write buffer over to flash.
+ * @param w the write context
+ * @return execution status
+ */
+static esp_err_t ota_wr_commit(struct ota_wctx *w)
+{
+	esp_err_t err;
+#ifdef CONFIG_SIMPLE_PUSHOTA_PIPELINE
+	struct ota_chunk chunk = { .data = w->buf, .len = w->fill };
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHECK_IMAGE
+	err = ota_wr_check(w, w->buf, w->fill);
+	if (err != ESP_OK)
+		return err;
+#endif
+
+	err = ota_wr_begin(w);
+	if (err != ESP_OK)
+		return err;
+
+	// e.g. wrong X-Decompressed-Length: don't write past the erased area
+	if (w->imglen != OTA_SIZE_UNKNOWN && w->done + w->fill > w->imglen) {
+		ESP_LOGE(TAG, "Image exceeds announced size");
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_DIGEST
+	if (w->digest)
+		mbedtls_sha256_update(&w->sha, (const unsigned char *)w->buf, w->fill);
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PIPELINE
+	xQueueSend(w->fullq, &chunk, portMAX_DELAY);
+	w->buf = NULL;
+	err = w->err;
+#else
+	err = ota_wr_flash(w, w->buf, w->fill);
+#endif
+	if (err == ESP_OK)
+		ota_wr_progress(w, w->fill);
+	w->fill = 0;
+	return err;
+}
+
+/**
+ * Get the next buffer space to fill with image data.
+ * @param w the write context
+ * @param size will be set to the available space in the returned buffer
+ * @return a pointer to the available buffer space or NULL on error
+ */
+static char *ota_wr_get(struct ota_wctx *w, int *size)
+{
+#ifdef CONFIG_SIMPLE_PUSHOTA_PIPELINE
+	struct ota_chunk chunk;
+
+	if (!w->buf) {
+		xQueueReceive(w->freeq, &chunk, portMAX_DELAY);
+		w->buf = chunk.data;
+	}
+	if (w->err != ESP_OK)
+		return NULL;
+#endif
+	*size = OTA_BUFSIZE - w->fill;
+	return w->buf + w->fill;
+}
+
+/**
+ * Commit data written to the space returned by the last ota_wr_get() call.
+ * With CONFIG_SIMPLE_PUSHOTA_COALESCE, data is only written to flash in full buffers.
+ * With CONFIG_SIMPLE_PUSHOTA_CHECK_IMAGE, the start of the image is kept until it can be checked.
+ * @param w the write context
+ * @param len the amount of data added to the buffer
+ * @return execution status
+ */
+static esp_err_t ota_wr_put(struct ota_wctx *w, int len)
+{
+	w->fill += len;
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHECK_IMAGE
+	if (ota_wr_hold(w))
+		return ESP_OK;
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_COALESCE
+	if (w->fill < OTA_BUFSIZE)
+		return ESP_OK;
+#endif
+	return ota_wr_commit(w);
+}
+
+/**
+ * Write any partial buffer left to flash.
+ * An image start still held for ota_wr_check() is then refused.
+ * @param w the write context
+ * @return execution status
+ */
+static esp_err_t ota_wr_flush(struct ota_wctx *w)
+{
+	return w->fill ? ota_wr_commit(w) : ESP_OK;
+}
+
+#ifdef OTA_ZEROCOPY
+/**
+ * Write image data to flash directly, bypassing the write buffer.
+ * With CONFIG_SIMPLE_PUSHOTA_CHECK_IMAGE, a start of the image too short to be checked
+ * is copied to the write buffer, until enough data has been received.
+ * @param w the write context, with an empty write buffer unless it holds the start of the image
+ * @param data the image data
+ * @param len the amount of image data
+ * @return execution status
+ */
+static esp_err_t ota_wr_direct(struct ota_wctx *w, const char *data, int len)
+{
+	esp_err_t err;
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHECK_IMAGE
+	int n, size;
+	char *s;
+
+	if (ota_wr_hold(w) && (w->fill || len < OTA_CHECK_LEN)) {
+		s = ota_wr_get(w, &size);
+		n = OTA_CHECK_LEN - w->fill;
+		if (n > len)
+			n = len;
+		memcpy(s, data, n);
+		err = ota_wr_put(w, n);	// commits once the check is possible
+		if (err != ESP_OK || n == len)
+			return err;
+		data += n;
+		len -= n;
+	}
+
+	err = ota_wr_check(w, data, len);
+	if (err != ESP_OK)
+		return err;
+#endif
+
+	err = ota_wr_begin(w);
+	if (err != ESP_OK)
+		return err;
+
+	if (w->imglen != OTA_SIZE_UNKNOWN && w->done + len > w->imglen) {
+		ESP_LOGE(TAG, "Image exceeds announced size");
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_DIGEST
+	if (w->digest)
+		mbedtls_sha256_update(&w->sha, (const unsigned char *)data, len);
+#endif
+
+	err = ota_wr_flash(w, data, len);
+	if (err == ESP_OK)
+		ota_wr_progress(w, len);
+
+	return err;
+}
+#endif
+
+#if defined(CONFIG_SIMPLE_PUSHOTA_INFLATE) || defined(CONFIG_SIMPLE_PUSHOTA_DELTA)
+/**
+ * Copy image data to the write buffer(s).
+ * @param w the write context
+ * @param data the image data
+ * @param len the amount of image data
+ * @return execution status
+ */
+static esp_err_t ota_wr_copy(struct ota_wctx *w, const void *data, int len)
+{
+	int n, size;
+	char *s;
+
+	while (len) {
+		s = ota_wr_get(w, &size);
+		if (!s)
+			return ESP_FAIL;
+		n = (size < len) ? size : len;
+		memcpy(s, data, n);
+		if (ota_wr_put(w, n) != ESP_OK)
+			return ESP_FAIL;
+		data = (const char *)data + n;
+		len -= n;
+	}
+
+	return ESP_OK;
+}
+#endif
+
+/**
+ * Stop the flash write path, waiting for all pending writes to complete.
+ * Safe to call if ota_wr_start() failed or was not called.
+ * @param w the write context
+ * @return execution status of the pending writes
+ */
+static esp_err_t ota_wr_stop(struct ota_wctx *w)
+{
+#ifdef CONFIG_SIMPLE_PUSHOTA_PIPELINE
+	struct ota_chunk chunk = { .data = NULL };
+
+	if (!w->fullq)
+		return ESP_FAIL;
+
+	xQueueSend(w->fullq, &chunk, portMAX_DELAY);
+	xSemaphoreTake(w->exited, portMAX_DELAY);
+
+	vQueueDelete(w->fullq);
+	vQueueDelete(w->freeq);
+	vSemaphoreDelete(w->exited);
+	heap_caps_free(w->pool);
+	w->fullq = w->freeq = NULL;
+	w->exited = NULL;
+	w->pool = NULL;
+
+	return w->err;
+#else
+	return ESP_OK;
+#endif
+}
+
+/**
+ * Finalize the OTA update.
+ * @param w the write context, stopped
+ * @return execution status
+ */
+static esp_err_t ota_wr_end(struct ota_wctx *w)
+{
+	if (!w->begun)
+		return ESP_ERR_INVALID_SIZE;
+
+	w->begun = false;
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARTWRITE
+ #ifdef CONFIG_SIMPLE_PUSHOTA_SKIP_UNCHANGED
+	ESP_LOGI(TAG, "%d unchanged sectors skipped", w->skipped);
+ #endif
+	return ESP_OK;	// image is verified by esp_ota_set_boot_partition()
+#else
+	return esp_ota_end(w->handle);
+#endif
+}
+
+/**
+ * Abort the OTA update, if any.
+ * @param w the write context, stopped
+ */
+static void ota_wr_abort(struct ota_wctx *w)
+{
+	if (!w->begun)
+		return;
+
+	w->begun = false;
+#if !defined(CONFIG_SIMPLE_PUSHOTA_PARTWRITE) && !defined(CONFIG_IDF_TARGET_ESP8266)
+	esp_ota_abort(w->handle);
+#endif
+}
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_RESUME
+/** Interrupted upload state, saved in NVS */
+struct ota_resume {
+	char label[sizeof(((esp_partition_t *)0)->label)];	///< target partition label
+	uint32_t total;			///< image size
+	uint32_t offset;		///< amount of image data written to flash
+	uint8_t sha256[32];		///< hash of the first offset bytes of the partition
+};
+
+/**
+ * Hash the beginning of a partition.
+ * @param part the partition
+ * @param len the amount of data to hash
+ * @param sha256 will be set to the hash
+ * @return execution status
+ */
+static esp_err_t ota_resume_hash(const esp_partition_t *part, size_t len, uint8_t *sha256)
+{
+	mbedtls_sha256_context ctx;
+	esp_err_t ret;
+
+	mbedtls_sha256_init(&ctx);
+	mbedtls_sha256_starts(&ctx, 0);
+	ret = ota_part_sha256(&ctx, part, len);
+	mbedtls_sha256_finish(&ctx, sha256);
+	mbedtls_sha256_free(&ctx);
+
+	return ret;
+}
+
+/**
+ * Load the interrupted upload state from NVS.
+ * @param r the state to fill
+ * @return execution status
+ */
+static esp_err_t ota_resume_load(struct ota_resume *r)
+{
+	nvs_handle_t nvs;
+	size_t len = sizeof(*r);
+	esp_err_t ret;
+
+	ret = nvs_open(RESUME_NVS_NAMESPACE, NVS_READONLY, &nvs);
+	if (ret != ESP_OK)
+		return ret;
+
+	ret = nvs_get_blob(nvs, RESUME_NVS_KEY, r, &len);
+	nvs_close(nvs);
+
+	if (ret == ESP_OK && len != sizeof(*r))
+		ret = ESP_ERR_INVALID_SIZE;
+
+	return ret;
+}
+
+/**
+ * Store (or clear) the interrupted upload state in NVS.
+ * @param r the state to store, NULL to clear
+ * @return execution status
+ */
+static esp_err_t ota_resume_store(const struct ota_resume *r)
+{
+	nvs_handle_t nvs;
+	esp_err_t ret;
+
+	ret = nvs_open(RESUME_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+	if (ret != ESP_OK)
+		return ret;
+
+	if (r)
+		ret = nvs_set_blob(nvs, RESUME_NVS_KEY, r, sizeof(*r));
+	else {
+		ret = nvs_erase_key(nvs, RESUME_NVS_KEY);
+		if (ret == ESP_ERR_NVS_NOT_FOUND)
+			ret = ESP_OK;
+	}
+	if (ret == ESP_OK)
+		ret = nvs_commit(nvs);
+	nvs_close(nvs);
+
+	return ret;
+}
+
+/**
+ * Save the progress of an interrupted upload, so that it can be resumed.
+ * @param w the write context, stopped
+ */
+static void ota_resume_save(struct ota_wctx *w)
+{
+	struct ota_resume r = { 0 };
+
+	// resume on a sector boundary, to keep writes sector aligned
+	r.offset = w->offset & ~(OTA_SECTOR_SIZE - 1);
+
+	if (!w->begun || w->imglen == OTA_SIZE_UNKNOWN || !r.offset)
+		return;
+
+	strncpy(r.label, w->part->label, sizeof(r.label) - 1);
+	r.total = w->imglen;
+
+	if (ota_resume_hash(w->part, r.offset, r.sha256) != ESP_OK || ota_resume_store(&r) != ESP_OK) {
+		ESP_LOGE(TAG, "Failed to save resume state");
+		return;
+	}
+
+	ESP_LOGI(TAG, "Upload can be resumed from offset %" PRIu32, r.offset);
+}
+
+/**
+ * Setup the write context to resume an interrupted upload.
+ * The range must start at the saved offset of an interrupted upload of the same size to the same partition,
+ * and the partition content up to that offset must be unchanged.
+ * A range starting at 0 is always accepted.
+ * @param w the write context
+ * @param range the "Content-Range" header value, i.e. "bytes first-[last/total]"
+ * @param len the request content length
+ * @param resume will be set to the offset from which the upload can be resumed, 0 if none
+ * @return execution status
+ */
+static esp_err_t ota_resume_check(struct ota_wctx *w, const char *range, int len, uint32_t *resume)
+{
+	struct ota_resume r;
+	uint8_t sha256[32];
+	unsigned int first, last, total;
+	int n = 0;
+
+	*resume = 0;
+
+	if (sscanf(range, "bytes %u-%n", &first, &n) != 1 || !n)
+		return ESP_ERR_INVALID_ARG;
+
+	if (sscanf(range + n, "%u/%u", &last, &total) == 2) {
+		if (last + 1 != total || total - first != len)
+			return ESP_ERR_INVALID_ARG;
+	}
+	else
+		total = first + len;
+
+	if (ota_resume_load(&r) == ESP_OK && !strcmp(r.label, w->part->label) && r.total == total &&
+	    ota_resume_hash(w->part, r.offset, sha256) == ESP_OK && !memcmp(sha256, r.sha256, sizeof(sha256)))
+		*resume = r.offset;
+
+	if (first && first != *resume)
+		return ESP_ERR_INVALID_STATE;
+
+	w->imglen = total;
+	w->start = first;
+
+	return ESP_OK;
+}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_DELTA
+#define DELTA_MAGIC	"ENDSLEY/BSDIFF43"
+#define DELTA_HDRLEN	24	///< magic + new size; also the control block length
+
+/** Patch parser states */
+enum {
+	DELTA_HDR,	///< patch header
+	DELTA_CTRL,	///< control block
+	DELTA_DIFF,	///< diff bytes, added to old bytes
+	DELTA_EXTRA,	///< extra bytes, copied as is
+};
+
+/** Streaming patch context */
+struct ota_delta {
+	const esp_partition_t *old;	///< source partition
+	int state;
+	int cnt;			///< bytes accumulated in hdr
+	uint8_t hdr[DELTA_HDRLEN];	///< header or control block
+	int64_t diff, extra, seek;	///< current control block
+	int64_t oldpos, newpos, newsize;
+	uint8_t in[];			///< patch input buffer, OTA_BUFSIZE long, only allocated when needed
+};
+
+/**
+ * Setup a patch context.
+ * @param inbuf true if the context must provide its own input buffer
+ * @return a patch context or NULL on error
+ */
+static struct ota_delta *ota_delta_init(bool inbuf)
+{
+	struct ota_delta *d;
+
+	d = heap_caps_malloc(sizeof(*d) + (inbuf ? OTA_BUFSIZE : 0), OTA_MALLOC_CAPS);
+	if (!d)
+		return NULL;
+
+	memset(d, 0, sizeof(*d));
+	d->old = esp_ota_get_running_partition();
+	d->state = DELTA_HDR;
+
+	return d;
+}
+
+/**
+ * Decode a bsdiff offset (sign-magnitude little endian).
+ * @param p the encoded offset
+ * @return the decoded value
+ */
+static int64_t ota_delta_offtin(const uint8_t *p)
+{
+	int64_t y = p[7] & 0x7f;
+	int i;
+
+	for (i = 6; i >= 0; i--)
+		y = (y << 8) | p[i];
+
+	return (p[7] & 0x80) ? -y : y;
+}
+
+/**
+ * Read old bytes from the source partition, out of range bytes read as 0.
+ * @param d the patch context
+ * @param s the destination buffer
+ * @param n the number of bytes to read at the current old position
+ * @return execution status
+ */
+static esp_err_t ota_delta_read(struct ota_delta *d, char *s, int n)
+{
+	int64_t lo = d->oldpos, hi = d->oldpos + n;
+
+	if (lo < 0)
+		lo = 0;
+	if (hi > d->old->size)
+		hi = d->old->size;
+
+	if (lo >= hi) {
+		memset(s, 0, n);
+		return ESP_OK;
+	}
+
+	memset(s, 0, lo - d->oldpos);
+	memset(s + (hi - d->oldpos), 0, d->oldpos + n - hi);
+	return esp_partition_read(d->old, lo, s + (lo - d->oldpos), hi - lo);
+}
+
+/**
+ * Apply patch data, writing the reconstructed image to the write buffer(s).
+ * The patch format is that of bsdiff 4.3 (ENDSLEY/BSDIFF43), without the bzip2 compression layer.
+ * @param d the patch context
+ * @param w the write context
+ * @param in patch data
+ * @param len patch data length
+ * @return execution status
+ */
+static esp_err_t ota_delta(struct ota_delta *d, struct ota_wctx *w, const uint8_t *in, int len)
+{
+	int i, n, size;
+	char *s;
+
+	while (len) {
+		switch (d->state) {
+		case DELTA_HDR:
+		case DELTA_CTRL:
+			n = (len < DELTA_HDRLEN - d->cnt) ? len : DELTA_HDRLEN - d->cnt;
+			memcpy(d->hdr + d->cnt, in, n);
+			d->cnt += n;
+			in += n;
+			len -= n;
+			if (d->cnt < DELTA_HDRLEN)
+				break;
+
+			d->cnt = 0;
+			if (d->state == DELTA_HDR) {
+				d->newsize = ota_delta_offtin(d->hdr + 16);
+				if (memcmp(d->hdr, DELTA_MAGIC, 16) || d->newsize <= 0 || d->newsize > w->part->size) {
+					ESP_LOGE(TAG, "Invalid patch header");
+					return ESP_FAIL;
+				}
+				w->imglen = d->newsize;
+				ESP_LOGI(TAG, "Image size: %" PRId64 " bytes", d->newsize);
+				d->state = DELTA_CTRL;
+				break;
+			}
+
+			d->diff = ota_delta_offtin(d->hdr);
+			d->extra = ota_delta_offtin(d->hdr + 8);
+			d->seek = ota_delta_offtin(d->hdr + 16);
+			if (d->diff < 0 || d->extra < 0 || d->newpos + d->diff + d->extra > d->newsize) {
+				ESP_LOGE(TAG, "Corrupt patch");
+				return ESP_FAIL;
+			}
+			d->state = DELTA_DIFF;
+			break;
+		case DELTA_DIFF:
+			if (!d->diff) {
+				d->state = DELTA_EXTRA;
+				break;
+			}
+			s = ota_wr_get(w, &size);
+			if (!s)
+				return ESP_FAIL;
+			n = (size < len) ? size : len;
+			if (n > d->diff)
+				n = d->diff;
+			if (ota_delta_read(d, s, n) != ESP_OK)
+				return ESP_FAIL;
+			for (i = 0; i < n; i++)
+				s[i] += in[i];
+			if (ota_wr_put(w, n) != ESP_OK)
+				return ESP_FAIL;
+			d->oldpos += n;
+			d->newpos += n;
+			d->diff -= n;
+			in += n;
+			len -= n;
+			break;
+		case DELTA_EXTRA:
+			if (!d->extra) {
+				d->oldpos += d->seek;
+				d->state = DELTA_CTRL;
+				break;
+			}
+			n = (len < d->extra) ? len : d->extra;
+			if (ota_wr_copy(w, in, n) != ESP_OK)
+				return ESP_FAIL;
+			d->newpos += n;
+			d->extra -= n;
+			in += n;
+			len -= n;
+			break;
+		}
+	}
+
+	return ESP_OK;
+}
+#endif /* CONFIG_SIMPLE_PUSHOTA_DELTA */
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_INFLATE
+/**
+ * Process decoded body data, i.e. either image data or patch data.
+ * @param b the body context
+ * @param data decoded data
+ * @param len decoded data length
+ * @return execution status
+ */
+static esp_err_t ota_body_data(struct ota_body *b, const void *data, int len)
+{
+#ifdef CONFIG_SIMPLE_PUSHOTA_DELTA
+	if (b->d)
+		return ota_delta(b->d, &b->w, data, len);
+#endif
+	return ota_wr_copy(&b->w, data, len);
+}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_INFLATE
+/** gzip header (RFC 1952) parser states */
+enum {
+	GZ_FIXED,	///< fixed 10 bytes header
+	GZ_XLEN,	///< FEXTRA length
+	GZ_EXTRA,	///< FEXTRA data
+	GZ_NAME,	///< FNAME zero-terminated string
+	GZ_COMMENT,	///< FCOMMENT zero-terminated string
+	GZ_HCRC,	///< FHCRC header crc
+	GZ_DONE,	///< deflate stream follows
+};
+
+#define GZ_FHCRC	0x02
+#define GZ_FEXTRA	0x04
+#define GZ_FNAME	0x08
+#define GZ_FCOMMENT	0x10
+
+/** Streaming decompression context */
+struct ota_inflate {
+	tinfl_decompressor inf;
+	uint32_t flags;			///< tinfl flags
+	int gzstate, gzcnt, gzflg, gzxlen;	///< gzip header parser state
+	bool done;			///< end of deflate stream reached
+	bool gzip;			///< gzip format, followed by a trailer
+	uint32_t crc, isize;		///< CRC32 and size of the inflated data, for the gzip trailer
+	uint8_t trailer[8];		///< gzip trailer: CRC32, ISIZE (little endian)
+	int tlen;			///< amount of trailer received
+	size_t dictofs;			///< current output offset in dict
+	uint8_t dict[TINFL_LZ_DICT_SIZE];	///< sliding window, also used as output buffer
+	uint8_t in[OTA_BUFSIZE];	///< compressed input buffer
+};
+
+/**
+ * Setup a decompression context.
+ * @param gzip true for gzip format, false for zlib ("deflate" content encoding) format
+ * @return a decompression context or NULL on error
+ */
+static struct ota_inflate *ota_inflate_init(bool gzip)
+{
+	struct ota_inflate *z;
+
+	z = heap_caps_malloc(sizeof(*z), OTA_MALLOC_CAPS);
+	if (!z)
+		return NULL;
+
+	tinfl_init(&z->inf);
+	z->flags = TINFL_FLAG_HAS_MORE_INPUT | (gzip ? 0 : TINFL_FLAG_PARSE_ZLIB_HEADER);
+	z->gzstate = gzip ? GZ_FIXED : GZ_DONE;
+	z->gzcnt = z->gzflg = z->gzxlen = 0;
+	z->done = false;
+	z->gzip = gzip;
+	z->crc = z->isize = 0;
+	z->tlen = 0;
+	z->dictofs = 0;
+
+	return z;
+}
+
+/**
+ * Find the next gzip header parser state.
+ * @param flg the gzip header flags
+ * @param state the current state
+ * @return the next state
+ */
+static int ota_inflate_gznext(int flg, int state)
+{
+	static const uint8_t need[] = { [GZ_XLEN] = GZ_FEXTRA, [GZ_NAME] = GZ_FNAME, [GZ_COMMENT] = GZ_FCOMMENT, [GZ_HCRC] = GZ_FHCRC };
+
+	while (++state < GZ_DONE) {
+		if (state != GZ_EXTRA && (flg & need[state]))
+			break;
+	}
+
+	return state;
+}
+
+/**
+ * Skip the gzip header.
+ * @param z the decompression context
+ * @param in input data
+ * @param len input data length
+ * @return the number of header bytes consumed, or -1 on invalid header
+ */
+static int ota_inflate_gzhdr(struct ota_inflate *z, const uint8_t *in, int len)
+{
+	static const uint8_t magic[] = { 0x1f, 0x8b, 8 };	// ID1, ID2, CM (deflate)
+	int i;
+
+	for (i = 0; i < len && z->gzstate != GZ_DONE; i++) {
+		switch (z->gzstate) {
+		case GZ_FIXED:
+			if (z->gzcnt < sizeof(magic) && in[i] != magic[z->gzcnt])
+				return -1;
+			if (z->gzcnt == 3)
+				z->gzflg = in[i];
+			if (++z->gzcnt == 10) {
+				z->gzcnt = 0;
+				z->gzstate = ota_inflate_gznext(z->gzflg, GZ_FIXED);
+			}
+			break;
+		case GZ_XLEN:
+			// little endian
+			z->gzxlen |= in[i] << (8 * z->gzcnt);
+			if (++z->gzcnt == 2) {
+				z->gzcnt = 0;
+				z->gzstate = z->gzxlen ? GZ_EXTRA : ota_inflate_gznext(z->gzflg, GZ_EXTRA);
+			}
+			break;
+		case GZ_EXTRA:
+			if (!--z->gzxlen)
+				z->gzstate = ota_inflate_gznext(z->gzflg, GZ_EXTRA);
+			break;
+		case GZ_NAME:
+		case GZ_COMMENT:
+			if (!in[i])
+				z->gzstate = ota_inflate_gznext(z->gzflg, z->gzstate);
+			break;
+		case GZ_HCRC:
+			if (++z->gzcnt == 2)
+				z->gzstate = GZ_DONE;
+			break;
+		}
+	}
+
+	return i;
+}
+
+/**
+ * Inflate compressed body data.
+ * The gzip trailer following the end of the deflate stream is kept for ota_inflate_end(), any further data is ignored.
+ * @param z the decompression context
+ * @param b the body context
+ * @param in compressed data
+ * @param len compressed data length
+ * @return execution status
+ */
+static esp_err_t ota_inflate(struct ota_inflate *z, struct ota_body *b, const uint8_t *in, int len)
+{
+	size_t inbytes, outbytes;
+	tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+	int n;
+
+	if (z->gzstate != GZ_DONE) {
+		n = ota_inflate_gzhdr(z, in, len);
+		if (n < 0) {
+			ESP_LOGE(TAG, "Invalid gzip header");
+			return ESP_FAIL;
+		}
+		in += n;
+		len -= n;
+	}
+
+	// consume all input, and all output it yields
+	while (!z->done && (len || status == TINFL_STATUS_HAS_MORE_OUTPUT)) {
+		inbytes = len;
+		outbytes = TINFL_LZ_DICT_SIZE - z->dictofs;
+		status = tinfl_decompress(&z->inf, in, &inbytes, z->dict, z->dict + z->dictofs, &outbytes, z->flags);
+		if (status < TINFL_STATUS_DONE) {
+			ESP_LOGE(TAG, "inflate failed (%d)", status);
+			return ESP_FAIL;
+		}
+
+		if (outbytes && ota_body_data(b, z->dict + z->dictofs, outbytes) != ESP_OK)
+			return ESP_FAIL;
+
+		if (z->gzip) {
+			z->crc = esp_rom_crc32_le(z->crc, z->dict + z->dictofs, outbytes);
+			z->isize += outbytes;
+		}
+		z->dictofs = (z->dictofs + outbytes) & (TINFL_LZ_DICT_SIZE - 1);
+		in += inbytes;
+		len -= inbytes;
+		z->done = (status == TINFL_STATUS_DONE);
+	}
+
+	if (z->done && z->gzip && len) {
+		n = sizeof(z->trailer) - z->tlen;
+		if (n > len)
+			n = len;
+		memcpy(z->trailer + z->tlen, in, n);
+		z->tlen += n;
+	}
+
+	return ESP_OK;
+}
+
+/**
+ * Check the end of the compressed stream.
+ * The zlib Adler-32 checksum is verified by the decompressor, the gzip trailer is verified here.
+ * @param z the decompression context
+ * @return execution status
+ */
+static esp_err_t ota_inflate_end(struct ota_inflate *z)
+{
+	const uint8_t *t = z->trailer;
+
+	if (!z->done) {
+		ESP_LOGE(TAG, "Truncated compressed stream");
+		return ESP_FAIL;
+	}
+
+	if (z->gzip && (z->tlen < sizeof(z->trailer) ||
+	    (t[0] | t[1] << 8 | t[2] << 16 | (uint32_t)t[3] << 24) != z->crc ||
+	    (t[4] | t[5] << 8 | t[6] << 16 | (uint32_t)t[7] << 24) != z->isize)) {
+		ESP_LOGE(TAG, "gzip trailer mismatch");
+		return ESP_ERR_INVALID_CRC;
+	}
+
+	return ESP_OK;
+}
+#endif /* CONFIG_SIMPLE_PUSHOTA_INFLATE */
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHUNKED
+/**
+ * Decode chunked transfer-coding, in place.
+ * Data is passed through unchanged if the body is not chunked.
+ * Chunk extensions and trailer fields are ignored, data past the end of the body is discarded.
+ * Lines may end with CRLF or a bare LF, a CR anywhere else is a framing error.
+ * @param k the decoder context
+ * @param data the received data, overwritten with the decoded data
+ * @param len the amount of received data
+ * @return the amount of decoded data or -1 on framing error
+ */
+static int ota_chunked(struct ota_chunked *k, char *data, int len)
+{
+	const char *in = data, *end = data + len;
+	char *out = data;
+	size_t n;
+	int v;
+
+	if (k->state == CHUNK_NONE)
+		return len;
+
+	while (in < end) {
+		if (k->cr) {
+			if (*in != '\n')
+				return -1;
+			k->cr = false;
+		}
+		switch (k->state) {
+		case CHUNK_SIZE:
+			v = *in++;
+			if (v >= '0' && v <= '9')
+				v -= '0';
+			else if ((v | 0x20) >= 'a' && (v | 0x20) <= 'f')
+				v = (v | 0x20) - 'a' + 10;
+			else if (v == ';' || v == ' ' || v == '\t') {
+				k->state = CHUNK_EXT;
+				break;
+			}
+			else if (v == '\r') {
+				k->cr = true;
+				break;
+			}
+			else if (v == '\n') {
+				if (!k->digits)
+					return -1;
+				k->state = k->left ? CHUNK_DATA : CHUNK_TRAILER;
+				break;
+			}
+			else
+				return -1;
+			if (k->left > (SIZE_MAX >> 4))
+				return -1;
+			k->left = (k->left << 4) | v;
+			k->digits = true;
+			break;
+		case CHUNK_EXT:
+			v = *in++;
+			if (v == '\r')
+				k->cr = true;
+			else if (v == '\n') {
+				if (!k->digits)
+					return -1;
+				k->state = k->left ? CHUNK_DATA : CHUNK_TRAILER;
+			}
+			break;
+		case CHUNK_DATA:
+			n = end - in;
+			if (n > k->left)
+				n = k->left;
+			memmove(out, in, n);
+			out += n;
+			in += n;
+			k->left -= n;
+			if (!k->left)
+				k->state = CHUNK_CRLF;
+			break;
+		case CHUNK_CRLF:
+			v = *in++;
+			if (v == '\n') {
+				k->state = CHUNK_SIZE;
+				k->digits = false;
+			}
+			else if (v == '\r')
+				k->cr = true;
+			else
+				return -1;
+			break;
+		case CHUNK_TRAILER:
+			v = *in++;
+			if (v == '\n') {
+				if (!k->field) {	// empty line
+					k->state = CHUNK_DONE;
+					return out - data;
+				}
+				k->field = false;
+			}
+			else if (v == '\r')
+				k->cr = true;
+			else
+				k->field = true;
+			break;
+		default:	// CHUNK_DONE
+			return out - data;
+		}
+	}
+
+	return out - data;
+}
+#endif /* CONFIG_SIMPLE_PUSHOTA_CHUNKED */
+
+/**
+ * Account for request body data received from the network.
+ * @param b the body context
+ * @param left the amount of body data left to receive before this data
+ * @param len the amount of received data
+ * @return the amount of body data left to receive
+ */
+static int ota_body_left(const struct ota_body *b, int left, int len)
+{
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHUNKED
+	if (b->k.state == CHUNK_DONE)	// self-delimited
+		return 0;
+#endif
+	return left - len;
+}
+
+/**
+ * Get buffer space for incoming request body data.
+ * @param b the body context
+ * @param size will be set to the available space in the returned buffer
+ * @return a pointer to the available buffer space or NULL on error
+ */
+static char *ota_body_get(struct ota_body *b, int *size)
+{
+#ifdef CONFIG_SIMPLE_PUSHOTA_INFLATE
+	if (b->z) {
+		*size = sizeof(b->z->in);
+		return (char *)b->z->in;
+	}
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_DELTA
+	if (b->d) {
+		*size = OTA_BUFSIZE;
+		return (char *)b->d->in;
+	}
+#endif
+	return ota_wr_get(&b->w, size);
+}
+
+/**
+ * Process request body data received in the space returned by the last ota_body_get() call.
+ * @param b the body context
+ * @param data the received data, may be modified
+ * @param len the amount of received data
+ * @return execution status
+ */
+static esp_err_t ota_body_put(struct ota_body *b, char *data, int len)
+{
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHUNKED
+	len = ota_chunked(&b->k, data, len);
+	if (len <= 0)
+		return len ? ESP_FAIL : ESP_OK;
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_INFLATE
+	if (b->z)
+		return ota_inflate(b->z, b, (const uint8_t *)data, len);
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_DELTA
+	if (b->d)
+		return ota_delta(b->d, &b->w, (const uint8_t *)data, len);
+#endif
+	return ota_wr_put(&b->w, len);
+}
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_NET_NETCONN
+/** Client connection */
+struct ota_conn {
+	struct netconn *nc;
+	struct netbuf *nb;		///< current receive buffer, or NULL
+	u16_t off;			///< amount of data consumed from the current netbuf segment
+	int timeout;			///< receive timeout (ms), 0 for none
+	bool nonblock;			///< true if receive calls must not wait for data
+};
+
+/** TCP options to set from the lwIP thread, see ota_pcb_opts() */
+struct ota_pcb_call {
+	struct tcpip_api_call_data call;	///< must be first
+	struct tcp_pcb *pcb;
+	const pushota_config_t *cfg;	///< connection options, or NULL for a listening connection
+};
+
+/**
+ * Set TCP options.
+ * The pcb belongs to the lwIP thread: this runs there, or with the core lock held, via tcpip_api_call().
+ * @param call the request, a struct ota_pcb_call
+ * @return ERR_OK
+ */
+static err_t ota_pcb_opts(struct tcpip_api_call_data *call)
+{
+	struct ota_pcb_call *c = (struct ota_pcb_call *)call;
+	const pushota_config_t *cfg = c->cfg;
+
+	if (!cfg) {
+#if SO_REUSE
+		ip_set_option(c->pcb, SOF_REUSEADDR);
+#endif
+		return ERR_OK;
+	}
+
+	// make sure unclean client shutdown won't DoS us
+	if (cfg->keepalive_idle) {
+		ip_set_option(c->pcb, SOF_KEEPALIVE);
+		c->pcb->keep_idle = cfg->keepalive_idle * 1000;
+#if LWIP_TCP_KEEPALIVE
+		c->pcb->keep_intvl = cfg->keepalive_interval * 1000;
+		c->pcb->keep_cnt = cfg->keepalive_count;
+#endif
+	}
+	tcp_nagle_disable(c->pcb);
+
+	return ERR_OK;
+}
+
+/**
+ * Setup push OTA listening tcp connection.
+ * @param cfg the configuration
+ * @return the listening connection or OTA_NO_LISTENER on error
+ */
+static ota_listener_t ota_listen(const pushota_config_t *cfg)
+{
+	ip_addr_t addr = *IP_ADDR_ANY;
+#if SO_REUSE
+	struct ota_pcb_call call = { .cfg = NULL };
+#endif
+	struct netconn *nc;
+	err_t err;
+
+	if (cfg->bind_addr && *cfg->bind_addr && !ipaddr_aton(cfg->bind_addr, &addr)) {
+		ESP_LOGE(TAG, "Invalid bind address: %s", cfg->bind_addr);
+		return OTA_NO_LISTENER;
+	}
+
+	nc = netconn_new(NETCONN_TCP);
+	if (!nc) {
+		ESP_LOGE(TAG, "netconn_new() failed");
+		return OTA_NO_LISTENER;
+	}
+
+#if SO_REUSE
+	call.pcb = nc->pcb.tcp;
+	tcpip_api_call(ota_pcb_opts, &call.call);
+#else
+	ESP_LOGW(TAG, "Warning: SO_REUSEADDR is not available!");
+#endif
+
+	err = netconn_bind(nc, &addr, cfg->port);
+	if (err != ERR_OK) {
+		ESP_LOGE(TAG, "netconn_bind(): %d", err);
+		goto fail;
+	}
+
+	err = netconn_listen_with_backlog(nc, cfg->backlog);
+	if (err != ERR_OK) {
+		ESP_LOGE(TAG, "netconn_listen(): %d", err);
+		goto fail;
+	}
+
+	ESP_LOGI(TAG, "Netconn port %d", cfg->port);
+
+	return nc;
+
+fail:
+	netconn_delete(nc);
+	return OTA_NO_LISTENER;
+}
+
+/**
+ * Close a listening connection.
+ * @param lconn the listening connection
+ */
+static void ota_unlisten(ota_listener_t lconn)
+{
+	netconn_close(lconn);
+	netconn_delete(lconn);
+}
+
+/**
+ * Set the accept timeout of a listening connection.
+ * @param lconn the listening connection
+ * @param ms the timeout (ms), 0 for none
+ */
+static void ota_listen_timeout(ota_listener_t lconn, int ms)
+{
+	netconn_set_recvtimeout(lconn, ms);
+}
+
+/**
+ * Accept an incoming connection.
+ * @param lconn the listening connection
+ * @param c the connection to setup
+ * @return execution status, ESP_ERR_TIMEOUT if the accept timeout expired
+ */
+static esp_err_t ota_accept(ota_listener_t lconn, struct ota_conn *c)
+{
+	err_t err;
+
+	c->nb = NULL;
+	c->off = 0;
+	c->nonblock = false;
+
+	err = netconn_accept(lconn, &c->nc);
+	if (err == ERR_TIMEOUT)
+		return ESP_ERR_TIMEOUT;
+	if (err != ERR_OK) {
+		ESP_LOGE(TAG, "netconn_accept(): %d", err);
+		return ESP_FAIL;
+	}
+
+	return ESP_OK;
+}
+
+/**
+ * Setup connection options.
+ * @param c the connection
+ * @param cfg the configuration
+ * @return execution status
+ */
+static esp_err_t ota_conn_opts(struct ota_conn *c, const pushota_config_t *cfg)
+{
+	struct ota_pcb_call call = { .pcb = c->nc->pcb.tcp, .cfg = cfg };
+
+	tcpip_api_call(ota_pcb_opts, &call.call);
+
+	if (cfg->rcvbuf) {
+#if LWIP_SO_RCVBUF
+		netconn_set_recvbufsize(c->nc, cfg->rcvbuf);
+#else
+		ESP_LOGW(TAG, "Warning: SO_RCVBUF is not available!");
+#endif
+	}
+
+	c->timeout = cfg->rcv_timeout * 1000;
+	netconn_set_recvtimeout(c->nc, c->timeout);
+
+	return ESP_OK;
+}
+
+/**
+ * Release the current netbuf segment if it has been consumed.
+ * @param c the connection
+ * @return true if received data is still pending
+ */
+static bool ota_pending(struct ota_conn *c)
+{
+	void *ptr;
+	u16_t n;
+
+	if (!c->nb)
+		return false;
+
+	netbuf_data(c->nb, &ptr, &n);
+	if (c->off < n)
+		return true;
+
+	c->off = 0;
+	if (netbuf_next(c->nb) >= 0)
+		return true;
+
+	netbuf_delete(c->nb);
+	c->nb = NULL;
+	return false;
+}
+
+/**
+ * Receive data without copying it.
+ * @param c the connection
+ * @param data will point to the received data, valid until the next receive call on this connection
+ * @param len the maximum amount of data to receive
+ * @return the amount of data received, 0 on EOF, -1 on error, OTA_AGAIN if none is available on a non-blocking connection
+ */
+static int ota_recv_ref(struct ota_conn *c, char **data, int len)
+{
+	void *ptr;
+	u16_t n;
+	err_t err;
+
+	if (!ota_pending(c)) {
+		// only receive calls may be non-blocking: netconn_write() would fail without bytes_written
+		if (c->nonblock)
+			netconn_set_nonblocking(c->nc, 1);
+		err = netconn_recv(c->nc, &c->nb);
+		if (c->nonblock)
+			netconn_set_nonblocking(c->nc, 0);
+		if (err != ERR_OK) {
+			c->nb = NULL;
+			if (err == ERR_WOULDBLOCK)
+				return OTA_AGAIN;
+			return (err == ERR_CLSD) ? 0 : -1;
+		}
+	}
+
+	netbuf_data(c->nb, &ptr, &n);
+	n -= c->off;
+	if (len < n)
+		n = len;
+
+	*data = (char *)ptr + c->off;
+	c->off += n;
+
+	return n;
+}
+
+/**
+ * Receive data.
+ * @param c the connection
+ * @param buf the receive buffer
+ * @param len the receive buffer size
+ * @return the amount of data received, 0 on EOF, -1 on error, OTA_AGAIN if none is available on a non-blocking connection
+ */
+static int ota_recv(struct ota_conn *c, char *buf, int len)
+{
+	char *data;
+	int n;
+
+	n = ota_recv_ref(c, &data, len);
+	if (n > 0)
+		memcpy(buf, data, n);
+
+	return n;
+}
+
+/**
+ * Send data.
+ * @param c the connection
+ * @param data the data to send
+ * @param len the data length
+ * @return the amount of data sent, or a negative value on error
+ */
+static int ota_send(struct ota_conn *c, const void *data, int len)
+{
+	return (netconn_write(c->nc, data, len, NETCONN_COPY) == ERR_OK) ? len : -1;
+}
+
+/**
+ * Wait for incoming data.
+ * @param c the connection to wait on
+ * @param timeout the timeout in seconds
+ * @return true if data (or EOF) is available for reading
+ */
+static bool ota_wait(struct ota_conn *c, int timeout)
+{
+	err_t err;
+
+	if (ota_pending(c))
+		return true;
+
+	netconn_set_recvtimeout(c->nc, timeout * 1000);
+	err = netconn_recv(c->nc, &c->nb);
+	netconn_set_recvtimeout(c->nc, c->timeout);
+
+	if (err != ERR_OK)
+		c->nb = NULL;
+	c->off = 0;
+
+	return (err != ERR_TIMEOUT);
+}
+
+/**
+ * Close a client connection.
+ * @param c the connection
+ */
+static void ota_close(struct ota_conn *c)
+{
+	if (c->nb)
+		netbuf_delete(c->nb);
+	netconn_close(c->nc);
+	netconn_delete(c->nc);
+}
+#else /* CONFIG_SIMPLE_PUSHOTA_NET_NETCONN */
+/** Client connection */
+struct ota_conn {
+	int sock;
+	bool nonblock;			///< true if receive calls must not wait for data
+};
+
+/**
+ * Setup push OTA listening tcp socket.
+ * @param cfg the configuration
+ * @return the listening socket or OTA_NO_LISTENER on error
+ */
+static ota_listener_t ota_listen(const pushota_config_t *cfg)
+{
+	// we only care about ipv4
+	struct sockaddr_in dest_addr;
+	int sock;
+
+	dest_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	dest_addr.sin_family = AF_INET;
+	dest_addr.sin_port = htons(cfg->port);
+
+	if (cfg->bind_addr && *cfg->bind_addr && !inet_aton(cfg->bind_addr, &dest_addr.sin_addr)) {
+		ESP_LOGE(TAG, "Invalid bind address: %s", cfg->bind_addr);
+		return OTA_NO_LISTENER;
+	}
+
+	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+	if (sock < 0) {
+		ESP_LOGE(TAG, "socket(): %s", strerror(errno));
+		return OTA_NO_LISTENER;
+	}
+
+#ifdef CONFIG_LWIP_SO_REUSE
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int))) {
+		ESP_LOGE(TAG, "SO_REUSEADDR: %s", strerror(errno));
+		goto fail;
+	}
+#else
+	ESP_LOGW(TAG, "Warning: SO_REUSEADDR is not available!");
+#endif
+
+	if (bind(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr))) {
+		ESP_LOGE(TAG, "bind(): %s", strerror(errno));
+		goto fail;
+	}
+
+	if (listen(sock, cfg->backlog)) {
+		ESP_LOGE(TAG, "listen(): %s", strerror(errno));
+		goto fail;
+	}
+
+	ESP_LOGI(TAG, "Socket port %d", cfg->port);
+
+	return sock;
+
+fail:
+	close(sock);
+	return OTA_NO_LISTENER;
+}
+
+/**
+ * Close a listening socket.
+ * @param lsock the listening socket
+ */
+static void ota_unlisten(ota_listener_t lsock)
+{
+	shutdown(lsock, SHUT_RDWR);
+	close(lsock);
+}
+
+/**
+ * Set the accept timeout of a listening socket.
+ * @param lsock the listening socket
+ * @param ms the timeout (ms), 0 for none
+ */
+static void ota_listen_timeout(ota_listener_t lsock, int ms)
+{
+	struct timeval tv = { .tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000 };
+
+	setsockopt(lsock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+/**
+ * Accept an incoming connection.
+ * @param lsock the listening socket
+ * @param c the connection to setup
+ * @return execution status, ESP_ERR_TIMEOUT if the accept timeout expired
+ */
+static esp_err_t ota_accept(ota_listener_t lsock, struct ota_conn *c)
+{
+	struct sockaddr_in source_addr;
+	socklen_t addr_len = sizeof(source_addr);
+
+	c->nonblock = false;
+	c->sock = accept(lsock, (struct sockaddr *)&source_addr, &addr_len);
+	if (c->sock < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return ESP_ERR_TIMEOUT;
+		ESP_LOGE(TAG, "accept(): %d", errno);
+		return ESP_FAIL;
+	}
+
+	return ESP_OK;
+}
+
+/**
+ * Setup connection options.
+ * @param c the connection
+ * @param cfg the configuration
+ * @return execution status
+ */
+static esp_err_t ota_conn_opts(struct ota_conn *c, const pushota_config_t *cfg)
+{
+	struct timeval tv = { .tv_sec = cfg->rcv_timeout };
+
+	// make sure unclean client shutdown won't DoS us
+	if (cfg->keepalive_idle) {
+		if (setsockopt(c->sock, SOL_SOCKET, SO_KEEPALIVE, &(int){ 1 }, sizeof(int))) {
+			ESP_LOGE(TAG, "SO_KEEPALIVE: %d", errno);
+			return ESP_FAIL;
+		}
+		// assume cannot fail if the above succeeds
+		setsockopt(c->sock, IPPROTO_TCP, TCP_KEEPIDLE, &cfg->keepalive_idle, sizeof(int));
+		setsockopt(c->sock, IPPROTO_TCP, TCP_KEEPINTVL, &cfg->keepalive_interval, sizeof(int));
+		setsockopt(c->sock, IPPROTO_TCP, TCP_KEEPCNT, &cfg->keepalive_count, sizeof(int));
+	}
+	setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
+
+	if (cfg->rcvbuf) {
+#ifdef CONFIG_LWIP_SO_RCVBUF
+		if (setsockopt(c->sock, SOL_SOCKET, SO_RCVBUF, &cfg->rcvbuf, sizeof(int)))
+			ESP_LOGW(TAG, "SO_RCVBUF: %d", errno);
+#else
+		ESP_LOGW(TAG, "Warning: SO_RCVBUF is not available!");
+#endif
+	}
+
+	if (cfg->rcv_timeout && setsockopt(c->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) {
+		ESP_LOGE(TAG, "SO_RCVTIMEO: %d", errno);
+		return ESP_FAIL;
+	}
+
+	return ESP_OK;
+}
+
+/**
+ * Receive data.
+ * @param c the connection
+ * @param buf the receive buffer
+ * @param len the receive buffer size
+ * @return the amount of data received, 0 on EOF, -1 on error, OTA_AGAIN if none is available on a non-blocking connection
+ */
+static int ota_recv(struct ota_conn *c, char *buf, int len)
+{
+	int n = recv(c->sock, buf, len, c->nonblock ? MSG_DONTWAIT : 0);
+
+	if (n < 0 && c->nonblock && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return OTA_AGAIN;
+
+	return n;
+}
+
+/**
+ * Send data.
+ * @param c the connection
+ * @param data the data to send
+ * @param len the data length
+ * @return the amount of data sent, or a negative value on error
+ */
+static int ota_send(struct ota_conn *c, const void *data, int len)
+{
+	return send(c->sock, data, len, 0);
+}
+
+/**
+ * Wait for incoming data.
+ * @param c the connection to wait on
+ * @param timeout the timeout in seconds
+ * @return true if data (or EOF) is available for reading
+ */
+static bool ota_wait(struct ota_conn *c, int timeout)
+{
+	struct timeval tv = { .tv_sec = timeout };
+	fd_set rfds;
+
+	FD_ZERO(&rfds);
+	FD_SET(c->sock, &rfds);
+
+	return select(c->sock + 1, &rfds, NULL, NULL, &tv) > 0;
+}
+
+/**
+ * Close a client connection.
+ * @param c the connection
+ */
+static void ota_close(struct ota_conn *c)
+{
+	shutdown(c->sock, SHUT_RDWR);
+	close(c->sock);
+}
+#endif /* CONFIG_SIMPLE_PUSHOTA_NET_NETCONN */
+
+
+/**
+ * Send an HTTP response, with extra headers.
+ * @param c the client connection
+ * @param buf a work buffer
+ * @param size the work buffer size
+ * @param status the HTTP response status
+ * @param keepalive true if the connection will be kept open
+ * @param hdrs optional extra header lines, each ending with "\r\n", or NULL
+ * @param fmt an optional printf-style format for the response content, or NULL
+ * @param ap the format arguments
+ */
+static void ota_vrespond(struct ota_conn *c, char *buf, int size, const char *status, bool keepalive,
+			 const char *hdrs, const char *fmt, va_list ap)
+{
+	va_list aq;
+	int len, clen = 0;
+
+	if (fmt) {
+		va_copy(aq, ap);
+		clen = vsnprintf(NULL, 0, fmt, aq);
+		va_end(aq);
+	}
+
+	// stop appending as soon as the buffer is full: len may then exceed size
+	len = snprintf(buf, size, "HTTP/1.1 %s\r\n%s", status, hdrs ? hdrs : "");
+	if (len < size && strncmp(status, "204", 3) && strncmp(status, "304", 3))
+		len += snprintf(buf + len, size - len, "Content-Length: %d\r\n", clen);
+	if (len < size)
+		len += snprintf(buf + len, size - len, "Connection: %s\r\n\r\n", keepalive ? "keep-alive" : "close");
+
+	if (len < size && fmt)
+		len += vsnprintf(buf + len, size - len, fmt, ap);
+
+	if (len >= size) {	// truncated
+		ESP_LOGW(TAG, "Response truncated to %d bytes", size - 1);
+		len = size - 1;
+	}
+
+	ota_send(c, buf, len);
+}
+
+/**
+ * Send an HTTP response.
+ * @param c the client connection
+ * @param buf a work buffer
+ * @param size the work buffer size
+ * @param status the HTTP response status
+ * @param keepalive true if the connection will be kept open
+ * @param fmt an optional printf-style format for the response content, or NULL
+ */
+static void ota_respond(struct ota_conn *c, char *buf, int size, const char *status, bool keepalive, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	ota_vrespond(c, buf, size, status, keepalive, NULL, fmt, ap);
+	va_end(ap);
+}
+
+#if defined(CONFIG_SIMPLE_PUSHOTA_ETAG) && defined(CONFIG_SIMPLE_PUSHOTA_GETVERSION)
+/**
+ * Send an HTTP response, with extra headers.
+ * @param c the client connection
+ * @param buf a work buffer
+ * @param size the work buffer size
+ * @param status the HTTP response status
+ * @param keepalive true if the connection will be kept open
+ * @param hdrs extra header lines, each ending with "\r\n"
+ * @param fmt an optional printf-style format for the response content, or NULL
+ */
+static void ota_respond_hdrs(struct ota_conn *c, char *buf, int size, const char *status, bool keepalive,
+			     const char *hdrs, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	ota_vrespond(c, buf, size, status, keepalive, hdrs, fmt, ap);
+	va_end(ap);
+}
+#endif
+
+#ifdef OTA_HDR_LOOKUP
+/** Request headers kept by the parser for later use, see ota_hnames */
+enum {
+ #if defined(CONFIG_SIMPLE_PUSHOTA_GETVERSION) || defined(CONFIG_SIMPLE_PUSHOTA_PARALLEL)
+	HDR_CONNECTION,
+ #endif
+ #ifdef CONFIG_SIMPLE_PUSHOTA_INFLATE
+	HDR_CONTENT_ENCODING,
+	HDR_DECOMPRESSED_LENGTH,
+ #endif
+ #if defined(CONFIG_SIMPLE_PUSHOTA_RESUME) || defined(CONFIG_SIMPLE_PUSHOTA_PARALLEL)
+	HDR_CONTENT_RANGE,
+ #endif
+ #ifdef CONFIG_SIMPLE_PUSHOTA_DIGEST
+	HDR_SHA256,
+	HDR_DIGEST,
+ #endif
+ #ifdef CONFIG_SIMPLE_PUSHOTA_ETAG
+	HDR_IF_NONE_MATCH,
+ #endif
+	HDR_COUNT
+};
+
+#define HDR_NAME(s)	{ s, sizeof(s) - 1 }
+
+/** Names of the kept request headers, including the trailing ':' */
+static const struct {
+	const char *name;
+	size_t len;
+} ota_hnames[HDR_COUNT] = {
+ #if defined(CONFIG_SIMPLE_PUSHOTA_GETVERSION) || defined(CONFIG_SIMPLE_PUSHOTA_PARALLEL)
+	[HDR_CONNECTION] = HDR_NAME("Connection:"),
+ #endif
+ #ifdef CONFIG_SIMPLE_PUSHOTA_INFLATE
+	[HDR_CONTENT_ENCODING] = HDR_NAME("Content-Encoding:"),
+	[HDR_DECOMPRESSED_LENGTH] = HDR_NAME("X-Decompressed-Length:"),
+ #endif
+ #if defined(CONFIG_SIMPLE_PUSHOTA_RESUME) || defined(CONFIG_SIMPLE_PUSHOTA_PARALLEL)
+	[HDR_CONTENT_RANGE] = HDR_NAME("Content-Range:"),
+ #endif
+ #ifdef CONFIG_SIMPLE_PUSHOTA_DIGEST
+	[HDR_SHA256] = HDR_NAME("X-SHA256:"),
+	[HDR_DIGEST] = HDR_NAME("Digest:"),
+ #endif
+ #ifdef CONFIG_SIMPLE_PUSHOTA_ETAG
+	[HDR_IF_NONE_MATCH] = HDR_NAME("If-None-Match:"),
+ #endif
+};
+#endif /* OTA_HDR_LOOKUP */
+
+/** Incremental request header parser */
+struct ota_hparse {
+	char *line;	///< start of the current (incomplete) line
+	char *end;	///< end of the data kept in the buffer
+	bool reqline;	///< true once the request line has been seen
+	long clen;	///< Content-Length value, -1 if absent
+	bool chunked;	///< Transfer-Encoding ends with "chunked"
+#ifdef OTA_HDR_LOOKUP
+	const char *hv[HDR_COUNT];	///< values of the kept headers (leading whitespace skipped), NULL if absent
+#endif
+};
+
+/**
+ * Process a complete header line.
+ * Header names are matched case-insensitively, the first occurrence of a kept header is used.
+ * @param p the parser state
+ * @param line the header line, which stays in place if kept
+ * @param n the line length, excluding the line terminator
+ * @return true if the line must be kept in the buffer
+ */
+static bool ota_hparse_line(struct ota_hparse *p, const char *line, size_t n)
+{
+#ifdef OTA_HDR_LOOKUP
+	const char *v;
+	int i;
+#endif
+
+	if (n > 15 && !strncasecmp(line, "Content-Length:", 15))
+		p->clen = strtol(line + 15, NULL, 10);	// stops at the line terminator
+	else if (n > 18 && !strncasecmp(line, "Transfer-Encoding:", 18)) {
+		// "chunked" must be the final coding: isolate it from its parameters and whitespace
+		const char *s = line + n, *e;
+
+		while (s > line + 18 && s[-1] != ',')
+			s--;
+		e = memchr(s, ';', line + n - s);
+		if (!e)
+			e = line + n;
+		while (s < e && (*s == ' ' || *s == '\t'))
+			s++;
+		while (e > s && (e[-1] == ' ' || e[-1] == '\t'))
+			e--;
+		p->chunked = (e - s == 7 && !strncasecmp(s, "chunked", 7));
+	}
+#ifdef OTA_HDR_LOOKUP
+	else {
+		for (i = 0; i < HDR_COUNT; i++) {
+			if (n < ota_hnames[i].len || strncasecmp(line, ota_hnames[i].name, ota_hnames[i].len))
+				continue;
+			if (p->hv[i])
+				break;
+			for (v = line + ota_hnames[i].len; *v == ' ' || *v == '\t'; v++)
+				;
+			p->hv[i] = v;
+			return true;
+		}
+	}
+#endif
+
+	return false;
+}
+
+/**
+ * Feed newly received data to the header parser.
+ * Each byte is only examined once: lines split across calls are resumed
+ * from p->line, which must point into the same buffer as @p s.
+ * Complete lines other than the request line and the kept headers are dropped from the buffer,
+ * moving the data that follows them: p->end is updated accordingly.
+ * @param p the parser state
+ * @param s the new data, contiguous to previously fed data
+ * @param len the length of the new data
+ * @return a pointer to the first byte past the header block, or NULL if more data is needed
+ */
+static char *ota_hparse(struct ota_hparse *p, char *s, int len)
+{
+	char *eol, *end = s + len, *ret = NULL;
+	size_t n;
+
+	while (s < end && (eol = memchr(s, '\n', end - s))) {
+		n = eol - p->line;
+		if (n && eol[-1] == '\r')
+			n--;
+		if (!n) {	// empty line: end of headers
+			ret = eol + 1;
+			break;
+		}
+		s = eol + 1;
+		if (!p->reqline)
+			p->reqline = true;
+		else if (!ota_hparse_line(p, p->line, n)) {
+			memmove(p->line, s, end - s);
+			end -= s - p->line;
+			s = p->line;
+			continue;
+		}
+		p->line = s;
+	}
+
+	p->end = end;
+	return ret;
+}
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_ETAG
+/**
+ * Get the entity tag of the running firmware: its quoted, hex encoded ELF SHA-256.
+ * @param etag will be filled with the null-terminated tag, OTA_ETAG_SIZE long
+ */
+static void ota_etag(char *etag)
+{
+	etag[0] = '"';
+	esp_app_get_elf_sha256(etag + 1, OTA_ETAG_SIZE - 2);
+	strcat(etag, "\"");
+}
+
+/**
+ * Check whether the If-None-Match request header, if any, matches the running firmware.
+ * Tags are compared weakly, as per RFC 9110.
+ * @param p the parsed request headers
+ * @param etag the running firmware entity tag
+ * @return true if the header is "*" or lists the running firmware tag
+ */
+static bool ota_etag_match(const struct ota_hparse *p, const char *etag)
+{
+	const size_t n = strlen(etag);
+	const char *s = p->hv[HDR_IF_NONE_MATCH];
+	const char *e;
+
+	if (!s)
+		return false;
+
+	for (e = s + strcspn(s, "\r\n"); s < e; s++) {
+		if (*s == '*')
+			return true;
+		if (*s != '"')	// separator or weak tag prefix
+			continue;
+		if (e - s >= n && !strncasecmp(s, etag, n))
+			return true;
+		s = memchr(s + 1, '"', e - s - 1);	// skip to the closing quote
+		if (!s)
+			break;
+	}
+
+	return false;
+}
+#endif
+
+#if defined(CONFIG_SIMPLE_PUSHOTA_GETVERSION) || defined(CONFIG_SIMPLE_PUSHOTA_PARALLEL)
+/**
+ * Check whether the client requested a persistent connection.
+ * HTTP/1.1 connections are persistent unless "Connection: close" is sent,
+ * HTTP/1.0 connections are only persistent if "Connection: keep-alive" is sent.
+ * @param hdrs the null-terminated request headers, starting with the request line
+ * @param p the parsed request headers
+ * @return true if the connection should be kept open
+ */
+static bool ota_keepalive(const char *hdrs, const struct ota_hparse *p)
+{
+	const char *eol = strstr(hdrs, "\r\n");
+	const char *conn = p->hv[HDR_CONNECTION];
+
+	if (!eol || eol - hdrs < 8)
+		return false;
+
+	if (!strncmp(eol - 8, "HTTP/1.1", 8))
+		return !(conn && !strncasecmp(conn, "close", 5));
+	else
+		return (conn && !strncasecmp(conn, "keep-alive", 10));
+}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_DIGEST
+/**
+ * Decode a hex digit.
+ * @param c the character
+ * @return the digit value, or -1 if c is not a hex digit
+ */
+static int ota_hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;	// lower case
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/**
+ * Parse the expected image hash from the request headers.
+ * Either "X-SHA256: <hex>" or "Digest: sha-256=<base64>" (RFC 3230) is accepted.
+ * @param p the parsed request headers
+ * @param sha256 will be set to the expected hash
+ * @return 1 if found, 0 if not provided, -1 if malformed
+ */
+static int ota_digest(const struct ota_hparse *p, uint8_t *sha256)
+{
+	const char *s;
+	size_t len;
+	int i, hi, lo;
+
+	// decoded by hand: newlib nano doesn't support "%hhx"
+	s = p->hv[HDR_SHA256];
+	if (s) {
+		for (i = 0; i < 32; i++, s += 2) {
+			hi = ota_hexval(s[0]);
+			lo = (hi < 0) ? -1 : ota_hexval(s[1]);
+			if (lo < 0)
+				return -1;
+			sha256[i] = hi << 4 | lo;
+		}
+		return 1;
+	}
+
+	s = p->hv[HDR_DIGEST];
+	// the header may list several algorithms, separated by commas
+	while (s && *s != '\r') {
+		while (*s == ' ' || *s == ',')
+			s++;
+		if (!strncasecmp(s, "sha-256=", 8)) {
+			s += 8;
+			if (mbedtls_base64_decode(sha256, 32, &len, (const unsigned char *)s,
+			    strspn(s, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/=")) || len != 32)
+				return -1;
+			return 1;
+		}
+		s = strpbrk(s, ",\r");
+	}
+
+	return 0;
+}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_BENCH
+/** Benchmark request types */
+enum {
+	BENCH_NONE,	///< not a benchmark
+	BENCH_NET,	///< payload is discarded
+	BENCH_FLASH,	///< payload is written to the update partition, which is not set as boot partition
+};
+#endif
+
+#if defined(CONFIG_SIMPLE_PUSHOTA_BENCH) || defined(CONFIG_SIMPLE_PUSHOTA_PARALLEL)
+static const pushota_config_t ota_nocb_cfg;	///< configuration without callbacks, for benchmarks and ranged uploads
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+#define OTA_STATS_FMT	"Headers: %" PRId64 " us\nBegin: %" PRId64 " us\nReceive: %" PRId64 " us\nWrite: %" PRId64 " us\n" \
+			"End: %" PRId64 " us\nSet boot: %" PRId64 " us\nTotal: %" PRId64 " us\n" \
+			"Received: %zu bytes\nWritten: %zu bytes\nChunks: %d-%d bytes\nRate: %" PRIu32 " bytes/s\n"
+#define OTA_STATS_ARGS(st)	(st)->header_us, (st)->begin_us, (st)->recv_us, (st)->write_us, \
+			(st)->end_us, (st)->boot_us, (st)->total_us, \
+			(st)->received, (st)->written, (st)->min_chunk, (st)->max_chunk, (st)->rate
+
+/**
+ * Compute a throughput.
+ * @param bytes the amount of data
+ * @param us the time (us) it took
+ * @return the throughput in bytes/s, 0 if unknown
+ */
+static uint32_t ota_rate(size_t bytes, int64_t us)
+{
+	uint64_t rate = (us > 0) ? (uint64_t)bytes * 1000000 / us : 0;
+
+	return (rate > UINT32_MAX) ? UINT32_MAX : rate;
+}
+
+/**
+ * Account for a payload receive call.
+ * @param st the statistics to update
+ * @param start the receive call start time
+ * @param len the receive call return value
+ */
+static void ota_stats_recv(pushota_stats_t *st, int64_t start, int len)
+{
+	st->recv_us += esp_timer_get_time() - start;
+	if (len <= 0)
+		return;
+
+	st->received += len;
+	if (!st->min_chunk || len < st->min_chunk)
+		st->min_chunk = len;
+	if (len > st->max_chunk)
+		st->max_chunk = len;
+}
+
+/**
+ * Finalize the request statistics.
+ * @param st the statistics to update
+ * @param start the request start time
+ */
+static void ota_stats_end(pushota_stats_t *st, int64_t start)
+{
+	st->total_us = esp_timer_get_time() - start;
+	st->rate = ota_rate(st->written, st->total_us);
+
+	ESP_LOGI(TAG, "%zu bytes in %" PRId64 " ms (%" PRIu32 " bytes/s), receive %" PRId64 " ms, write %" PRId64 " ms",
+		 st->written, st->total_us / 1000, st->rate, st->recv_us / 1000, st->write_us / 1000);
+}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+/**
+ * Update session, shared by the connections served in parallel.
+ * Ranged uploads may span several pushota() calls: their progress is kept until the image is complete
+ * or a full upload is requested.
+ */
+static struct {
+	SemaphoreHandle_t lock;		///< protects the members below
+	SemaphoreHandle_t exits;	///< counting semaphore given by each worker task as it exits
+	const pushota_config_t *cfg;	///< configuration of the current pushota() call
+	int conns;			///< connections being served
+	esp_err_t ret;			///< outcome of the current pushota() call
+	bool update;			///< true while a full upload (or flash benchmark) is in progress
+	int ranges;			///< number of ranges being written
+	size_t imglen;			///< image size of the ranged upload in progress, 0 if none
+	struct ota_blkmap done;		///< sectors written
+	struct ota_blkmap busy;		///< sectors being written
+} ota_sess;
+
+/**
+ * Create the session lock, if not done yet. The area erased ahead of the update shares that lock.
+ * @return execution status
+ */
+static esp_err_t ota_sess_init(void)
+{
+	if (!ota_sess.lock) {
+		ota_sess.lock = xSemaphoreCreateMutex();
+		if (!ota_sess.lock)
+			return ESP_ERR_NO_MEM;
+#ifdef OTA_CLEAN
+		ota_clean.lock = ota_sess.lock;
+#endif
+	}
+
+	return ESP_OK;
+}
+
+/**
+ * Forget the ranged upload in progress, if any. Must be called with the session lock held.
+ */
+static void ota_sess_reset(void)
+{
+	heap_caps_free(ota_sess.done.bits);
+	heap_caps_free(ota_sess.busy.bits);
+	memset(&ota_sess.done, 0, sizeof(ota_sess.done));
+	memset(&ota_sess.busy, 0, sizeof(ota_sess.busy));
+	ota_sess.imglen = 0;
+}
+
+/**
+ * Claim the target partition for a full upload.
+ * This forgets any unfinished ranged upload.
+ * @return true if no other upload is in progress
+ */
+static bool ota_sess_update(void)
+{
+	bool ok;
+
+	xSemaphoreTake(ota_sess.lock, portMAX_DELAY);
+	ok = !ota_sess.update && !ota_sess.ranges;
+	if (ok) {
+		ota_sess.update = true;
+		ota_sess_reset();
+	}
+	xSemaphoreGive(ota_sess.lock);
+
+	return ok;
+}
+
+/**
+ * Release the target partition after a full upload.
+ */
+static void ota_sess_update_end(void)
+{
+	xSemaphoreTake(ota_sess.lock, portMAX_DELAY);
+	ota_sess.update = false;
+	xSemaphoreGive(ota_sess.lock);
+}
+
+/**
+ * Claim the sectors of a ranged upload.
+ * Ranges must start on a sector boundary and end on a sector boundary or at the end of the image,
+ * and must not overlap a range being written.
+ * @param range the Content-Range header value: "bytes FIRST-LAST/TOTAL"
+ * @param len the payload length
+ * @param part the target partition
+ * @param first will be set to the first range offset
+ * @param total will be set to the image size
+ * @return NULL on success or an HTTP status
+ */
+static const char *ota_sess_claim(const char *range, int len, const esp_partition_t *part, size_t *first, size_t *total)
+{
+	const pushota_config_t *cfg = ota_sess.cfg;
+	const char *status = NULL;
+	unsigned int f, l, t;
+	size_t n;
+
+	if (sscanf(range, "bytes %u-%u/%u", &f, &l, &t) != 3 || f > l || l >= t || l - f + 1 != len || t > part->size ||
+	    (f % OTA_SECTOR_SIZE) || ((l + 1) % OTA_SECTOR_SIZE && l + 1 != t))
+		return "416 Range Not Satisfiable";
+
+	xSemaphoreTake(ota_sess.lock, portMAX_DELAY);
+
+	if (ota_sess.update || (ota_sess.imglen && ota_sess.imglen != t)) {
+		status = "409 Conflict";
+		goto out;
+	}
+
+	if (!ota_sess.imglen) {
+		n = (t + OTA_SECTOR_SIZE - 1) / OTA_SECTOR_SIZE;
+		if (ota_blkmap_init(&ota_sess.done, n) != ESP_OK || ota_blkmap_init(&ota_sess.busy, n) != ESP_OK) {
+			ESP_LOGE(TAG, "Out of memory");
+			ota_sess_reset();
+			status = "503 Service Unavailable";
+			goto out;
+		}
+		ota_sess.imglen = t;
+		ESP_LOGI(TAG, "Ranged upload, image size: %u bytes", t);
+		if (cfg->begin_cb)
+			cfg->begin_cb(cfg->cb_arg, t);
+	}
+
+	for (n = f / OTA_SECTOR_SIZE; n <= l / OTA_SECTOR_SIZE; n++) {
+		if (ota_blkmap_get(&ota_sess.busy, n)) {
+			status = "409 Conflict";
+			goto out;
+		}
+	}
+
+	// sectors will be rewritten
+	for (n = f / OTA_SECTOR_SIZE; n <= l / OTA_SECTOR_SIZE; n++) {
+		ota_blkmap_set(&ota_sess.busy, n);
+		ota_blkmap_clear(&ota_sess.done, n);
+	}
+	ota_sess.ranges++;
+
+	*first = f;
+	*total = t;
+
+out:
+	xSemaphoreGive(ota_sess.lock);
+	return status;
+}
+
+/**
+ * Release the sectors of a ranged upload.
+ * @param first the first range offset
+ * @param len the range length
+ * @param ok true if the range has been written
+ * @param missing will be set to the number of sectors still missing
+ * @return true if this completed the image
+ */
+static bool ota_sess_release(size_t first, int len, bool ok, size_t *missing)
+{
+	const pushota_config_t *cfg = ota_sess.cfg;
+	size_t n, written;
+	bool complete;
+
+	xSemaphoreTake(ota_sess.lock, portMAX_DELAY);
+
+	for (n = first / OTA_SECTOR_SIZE; n <= (first + len - 1) / OTA_SECTOR_SIZE; n++) {
+		ota_blkmap_clear(&ota_sess.busy, n);
+		if (ok)
+			ota_blkmap_set(&ota_sess.done, n);
+	}
+	ota_sess.ranges--;
+
+	*missing = ota_sess.done.missing;
+	complete = ok && !ota_sess.done.missing;
+
+	if (ok && cfg->progress_cb) {
+		written = (ota_sess.done.nblocks - ota_sess.done.missing) * OTA_SECTOR_SIZE;
+		cfg->progress_cb(cfg->cb_arg, (written > ota_sess.imglen) ? ota_sess.imglen : written, ota_sess.imglen);
+	}
+
+	if (complete)
+		ota_sess_reset();
+
+	xSemaphoreGive(ota_sess.lock);
+
+	return complete;
+}
+#endif /* CONFIG_SIMPLE_PUSHOTA_PARALLEL */
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_FANOUT
+/** Image written by the last successful update, see pushota_fanout() */
+static struct {
+	const esp_partition_t *part;	///< partition holding the image, NULL if none
+	size_t len;			///< image size
+} ota_last;
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_EXPORT
+/**
+ * Stream a partition to the client.
+ * Blocks of OTA_EXPORT_BLK bytes are sent straight from memory-mapped flash,
+ * or read into the work buffer if they cannot be mapped.
+ * @param conn the client connection
+ * @param buf a work buffer of OTA_BUFSIZE bytes
+ * @param label the requested partition label, followed by the rest of the request line
+ */
+static void ota_export(struct ota_conn *conn, char *buf, const char *label)
+{
+	const esp_partition_t *part = NULL;
+	char name[sizeof(part->label)];
+	size_t off, n;
+	int len;
+#ifndef CONFIG_IDF_TARGET_ESP8266
+	esp_partition_mmap_handle_t map;
+	const void *p;
+#endif
+
+	n = strcspn(label, " ?");
+	if (n < sizeof(name)) {
+		memcpy(name, label, n);
+		name[n] = '\0';
+		part = esp_partition_find_first(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, name);
+	}
+	if (!part) {
+		ota_respond(conn, buf, OTA_BUFSIZE, "404 Not Found", false, NULL);
+		return;
+	}
+#ifndef CONFIG_SIMPLE_PUSHOTA_EXPORT_DATA
+	if (part->type != ESP_PARTITION_TYPE_APP) {
+		ota_respond(conn, buf, OTA_BUFSIZE, "403 Forbidden", false, NULL);
+		return;
+	}
+#endif
+
+	ESP_LOGI(TAG, "Exporting %s (%" PRIu32 " bytes)", part->label, part->size);
+	len = snprintf(buf, OTA_BUFSIZE, "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+		       "Content-Length: %" PRIu32 "\r\nConnection: close\r\n\r\n", part->size);
+	if (ota_send(conn, buf, len) != len)
+		return;
+
+	for (off = 0; off < part->size; off += n) {
+		n = part->size - off;
+		if (n > OTA_EXPORT_BLK)
+			n = OTA_EXPORT_BLK;
+#ifndef CONFIG_IDF_TARGET_ESP8266
+		if (esp_partition_mmap(part, off, n, ESP_PARTITION_MMAP_DATA, &p, &map) == ESP_OK) {
+			len = ota_send(conn, p, n);
+			esp_partition_munmap(map);
+		}
+		else
+#endif
+		{
+			// e.g. out of free MMU pages
+			if (n > OTA_BUFSIZE)
+				n = OTA_BUFSIZE;
+			len = (esp_partition_read(part, off, buf, n) == ESP_OK) ? ota_send(conn, buf, n) : -1;
+		}
+		if (len != n) {
+			ESP_LOGE(TAG, "Export aborted at offset %zu", off);
+			return;
+		}
+	}
+
+	ESP_LOGI(TAG, "Export complete");
+}
+#endif
+
+/** Request processing state, see ota_req_step() */
+enum {
+	REQ_HEADERS,	///< receiving the request headers
+	REQ_BODY,	///< receiving the request body
+	REQ_DONE,	///< request processed, see ota_req.ret and ota_req.pending
+};
+
+/** How ota_req_end() completes a request */
+enum {
+	END_BODY,	///< the body has been received, or the connection closed before
+	END_FAIL,	///< the update failed
+	END_STATUS,	///< respond with ota_req.status
+	END_OUT,	///< a response has already been sent
+};
+
+/** Request processing context, kept across ota_req_step() calls */
+struct ota_req {
+	int state;
+	struct ota_body b;		///< body processing context
+	struct ota_hparse hp;		///< header parser
+	char *buf;			///< work buffer, OTA_BUFSIZE long
+	int fill;			///< amount of request data in buf, while receiving the headers
+	int unparsed;			///< amount of request data received before the first step
+	int binlen;			///< amount of body data left to receive
+	const esp_partition_t *upart;	///< target partition
+	const pushota_config_t *cfg;
+	const char *status;		///< HTTP response status on failure
+	esp_err_t ret;			///< execution status, once done
+	int pending;			///< once done, -1 if the connection must be closed, or the amount of data received for the next request
+#ifdef CONFIG_SIMPLE_PUSHOTA_DIGEST
+	uint8_t digest[32];		///< expected image hash
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	int64_t start;			///< request start time
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_BENCH
+	int bench;
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+	bool put, update, ranged, keepalive;
+	size_t first, total;		///< ranged upload offset and image size
+	int rlen;			///< ranged upload length
+#endif
+};
+
+/**
+ * Setup a request context.
+ * @param r the request
+ * @param buf a work buffer of OTA_BUFSIZE bytes
+ * @param pending the amount of request data already received at the start of buf
+ * @param cfg the configuration, for callbacks and statistics
+ */
+static void ota_req_init(struct ota_req *r, char *buf, int pending, const pushota_config_t *cfg)
+{
+	memset(r, 0, sizeof(*r));
+#ifdef CONFIG_SIMPLE_PUSHOTA_PREPARE
+	r->upart = ota_prep.part ? ota_prep.part : esp_ota_get_next_update_partition(NULL);
+#else
+	r->upart = esp_ota_get_next_update_partition(NULL);
+#endif
+	r->hp.line = buf;
+	r->hp.clen = -1;
+	r->buf = buf;
+	r->unparsed = pending;
+	r->cfg = cfg;
+	r->status = "500 Internal Server Error";
+	r->ret = ESP_FAIL;
+	r->pending = -1;
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	r->start = esp_timer_get_time();
+#endif
+}
+
+/**
+ * Complete a request: finish the update if the body has been received, respond and release resources.
+ * @param conn the client connection
+ * @param r the request
+ * @param how END_BODY, or where to pick up on failure
+ */
+static void ota_req_end(struct ota_conn *conn, struct ota_req *r, int how)
+{
+	struct ota_body *b = &r->b;
+	char *buf = r->buf;
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+	size_t missing;
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	int64_t t;
+#endif
+
+	r->state = REQ_DONE;
+
+	switch (how) {
+	case END_FAIL:
+		goto failota;
+	case END_STATUS:
+		goto outstatus;
+	case END_OUT:
+		goto out;
+	}
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_BENCH
+	if (r->bench == BENCH_NET) {
+		if (r->binlen)
+			goto outstatus;
+		goto outbench;
+	}
+#endif
+
+	if (ota_wr_flush(&b->w) != ESP_OK || ota_wr_stop(&b->w) != ESP_OK)
+		goto failota;
+
+	if (r->binlen)	// incomplete transfer
+		goto failota;
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+	if (r->put)
+		goto outrange;
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_BENCH
+	if (r->bench == BENCH_FLASH) {
+		ota_wr_abort(&b->w);	// leave the boot partition alone
+		goto outbench;
+	}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_INFLATE
+	if (b->z && ota_inflate_end(b->z) != ESP_OK)
+		goto failota;
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_DELTA
+	if (b->d && (b->d->state == DELTA_HDR || b->d->newpos != b->d->newsize)) {
+		ESP_LOGE(TAG, "Truncated patch");
+		goto failota;
+	}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_DIGEST
+	if (b->w.digest) {
+		uint8_t sha256[32];
+
+		mbedtls_sha256_finish(&b->w.sha, sha256);
+		if (memcmp(sha256, r->digest, sizeof(sha256))) {
+			ESP_LOGE(TAG, "Digest mismatch");
+			ota_wr_abort(&b->w);	// don't keep corrupted data for resuming
+			r->status = "400 Bad Request";
+			goto outstatus;
+		}
+		ESP_LOGI(TAG, "Digest verified");
+	}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	t = esp_timer_get_time();
+#endif
+	r->ret = ota_wr_end(&b->w);
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	b->w.st.end_us = esp_timer_get_time() - t;
+#endif
+	if (r->ret != ESP_OK)
+		goto out;
+
+	ESP_LOGI(TAG, "Flash complete");
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	t = esp_timer_get_time();
+#endif
+	r->ret = esp_ota_set_boot_partition(r->upart);
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	b->w.st.boot_us = esp_timer_get_time() - t;
+	ota_stats_end(&b->w.st, r->start);
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_RESUME
+	if (r->ret == ESP_OK)
+		ota_resume_store(NULL);
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_FANOUT
+	if (r->ret == ESP_OK) {
+		ota_last.part = r->upart;
+		ota_last.len = b->w.done;
+	}
+#endif
+	if (r->ret == ESP_OK)
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS_RESPONSE
+		ota_respond(conn, buf, OTA_BUFSIZE, "200 OK", false, "Next boot partition: %s\n" OTA_STATS_FMT,
+			    r->upart->label, OTA_STATS_ARGS(&b->w.st));
+#else
+		ota_respond(conn, buf, OTA_BUFSIZE, "200 OK", false, "Next boot partition: %s\n", r->upart->label);
+#endif
+	else
+		ota_respond(conn, buf, OTA_BUFSIZE, "500 Internal Server Error", false, "Failed (%d).\n", r->ret);
+
+	goto out;
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_BENCH
+outbench:
+	ota_stats_end(&b->w.st, r->start);
+	t = b->w.st.total_us - b->w.st.header_us;
+	ota_respond(conn, buf, OTA_BUFSIZE, "200 OK", false,
+		    "Network: %" PRIu32 " bytes/s\nFlash: %" PRIu32 " bytes/s\nCombined: %" PRIu32 " bytes/s\n" OTA_STATS_FMT,
+		    ota_rate(b->w.st.received, b->w.st.recv_us), ota_rate(b->w.st.written, b->w.st.begin_us + b->w.st.write_us),
+		    ota_rate((r->bench == BENCH_FLASH) ? b->w.st.written : b->w.st.received, t), OTA_STATS_ARGS(&b->w.st));
+	r->ret = ESP_FAIL;	// not an update
+	goto out;
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+outrange:
+	ota_wr_end(&b->w);
+	r->ranged = false;
+	if (!ota_sess_release(r->first, r->rlen, true, &missing)) {
+		ota_respond(conn, buf, OTA_BUFSIZE, "200 OK", r->keepalive, "Missing: %zu sectors\n", missing);
+		r->pending = r->keepalive ? 0 : -1;
+		goto out;	// not an update (yet)
+	}
+
+	ESP_LOGI(TAG, "Flash complete");
+
+	r->ret = esp_ota_set_boot_partition(r->upart);
+#ifdef CONFIG_SIMPLE_PUSHOTA_FANOUT
+	if (r->ret == ESP_OK) {
+		ota_last.part = r->upart;
+		ota_last.len = r->total;
+	}
+#endif
+	if (r->ret == ESP_OK)
+		ota_respond(conn, buf, OTA_BUFSIZE, "200 OK", false, "Next boot partition: %s\n", r->upart->label);
+	else
+		ota_respond(conn, buf, OTA_BUFSIZE, "500 Internal Server Error", false, "Failed (%d).\n", r->ret);
+
+	// report the outcome of the whole session
+	if (r->ret == ESP_OK) {
+		if (r->cfg->end_cb)
+			r->cfg->end_cb(r->cfg->cb_arg);
+	}
+	else if (r->cfg->fail_cb)
+		r->cfg->fail_cb(r->cfg->cb_arg, r->ret);
+	goto out;
+#endif
+
+failota:
+	ESP_LOGE(TAG, "ota_receive() failed");
+	ota_wr_stop(&b->w);
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHECK_IMAGE
+	if (b->w.reject)
+		r->status = b->w.reject;
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_RESUME
+	if (!b->z && !b->d
+ #ifdef CONFIG_SIMPLE_PUSHOTA_BENCH
+	    && r->bench == BENCH_NONE
+ #endif
+ #ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+	    && !r->put
+ #endif
+	    )
+		ota_resume_save(&b->w);
+#endif
+	ota_wr_abort(&b->w);
+outstatus:
+	ota_respond(conn, buf, OTA_BUFSIZE, r->status, false, NULL);
+out:
+	// once the update has begun, report its outcome
+	if (b->w.notified) {
+		if (r->ret == ESP_OK) {
+			if (b->w.cfg->end_cb)
+				b->w.cfg->end_cb(b->w.cfg->cb_arg);
+		}
+		else if (b->w.cfg->fail_cb)
+			b->w.cfg->fail_cb(b->w.cfg->cb_arg, r->ret);
+	}
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	if (r->cfg->stats && b->w.part
+ #ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+	    && !r->put	// concurrent requests
+ #endif
+	    ) {
+		if (!b->w.st.total_us)	// failed
+			ota_stats_end(&b->w.st, r->start);
+		*r->cfg->stats = b->w.st;
+	}
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_DIGEST
+	if (b->w.digest)
+		mbedtls_sha256_free(&b->w.sha);
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+	if (r->ranged)
+		ota_sess_release(r->first, r->rlen, false, &missing);
+	if (r->update)
+		ota_sess_update_end();
+#endif
+	heap_caps_free(b->z);
+	heap_caps_free(b->d);
+	b->z = NULL;
+	b->d = NULL;
+}
+
+/**
+ * Process complete request headers: answer the request right away, or setup the update and process
+ * the body data received along with the headers.
+ * @param conn the client connection
+ * @param r the request
+ * @param binstart the end of the headers in the work buffer
+ */
+static void ota_req_start(struct ota_conn *conn, struct ota_req *r, char *binstart)
+{
+	struct ota_body *b = &r->b;
+	const pushota_config_t *cfg = r->cfg;
+	char c, *s, *buf = r->buf;
+#if defined(CONFIG_SIMPLE_PUSHOTA_INFLATE) || defined(CONFIG_SIMPLE_PUSHOTA_RESUME) || defined(CONFIG_SIMPLE_PUSHOTA_PARALLEL)
+	const char *hdr;
+#endif
+	int len, size;
+#ifdef CONFIG_SIMPLE_PUSHOTA_ETAG
+	char etag[OTA_ETAG_SIZE];
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	b->w.st.header_us = esp_timer_get_time() - r->start;
+#endif
+
+	// leftover buffer, start of app image
+	len = buf + r->fill - binstart;
+
+	// move null termination to header end before further processing
+	c = *binstart;
+	*binstart = '\0';
+
+	/*
+	 parse POST header (no space around '/' in Accept), e.g.:
+
+	 POST / HTTP/1.1
+	 Host: localhost:8888
+	 Authorization: Basic dXNlcjpwYXNz
+	 User-Agent: curl/7.64.1
+	 Accept: * / *
+	 Content-Length: 182
+	 Content-Type: application/octet-stream
+	*/
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_EXPORT
+	if (!strncmp(buf, "GET /partition/", 15)) {
+		ota_export(conn, buf, buf + 15);
+		goto done;	// not an update, the connection is closed
+	}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_GETVERSION
+	if (!strncmp(buf, "GET ", 4)) {
+		const esp_app_desc_t *desc = esp_app_get_description();
+		bool keepalive = ota_keepalive(buf, &r->hp);
+#ifdef CONFIG_SIMPLE_PUSHOTA_ETAG
+		char hdrs[sizeof("ETag: \r\n") + OTA_ETAG_SIZE];
+		bool match;
+
+		ota_etag(etag);
+		match = ota_etag_match(&r->hp, etag);
+		snprintf(hdrs, sizeof(hdrs), "ETag: %s\r\n", etag);
+#endif
+
+		// keep any data pertaining to the next request, if it leaves enough room for the response
+		*binstart = c;
+		if (len > OTA_BUFSIZE / 2)
+			keepalive = false;
+		if (keepalive)
+			memmove(buf, binstart, len);
+		else
+			len = 0;
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_ETAG
+		if (match)
+			ota_respond_hdrs(conn, buf + len, OTA_BUFSIZE - len, "304 Not Modified", keepalive, hdrs, NULL);
+		else
+			ota_respond_hdrs(conn, buf + len, OTA_BUFSIZE - len, "200 OK", keepalive, hdrs, "Version: %s\n", desc->version);
+#else
+		ota_respond(conn, buf + len, OTA_BUFSIZE - len, "200 OK", keepalive, "Version: %s\n", desc->version);
+#endif
+		r->pending = keepalive ? len : -1;
+		goto done;
+	}
+#endif
+
+	// provide a way to abort
+	if (!strncmp(buf, "DELETE ", 7)) {
+		r->status = "204 No Content";
+		ESP_LOGI(TAG, "Aborting.");
+		r->ret = ESP_OK;
+		goto outstatus;
+	}
+
+	if (strncmp(buf, "POST ", 5)
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+	    && !(r->put = !strncmp(buf, "PUT ", 4))
+#endif
+	    ) {
+		r->status = "405 Method Not Allowed";
+		goto outstatus;
+	}
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_ETAG
+	// the client already knows the image it is about to send is running
+	ota_etag(etag);
+	if (ota_etag_match(&r->hp, etag)) {
+		ESP_LOGI(TAG, "Image already running");
+		r->status = "412 Precondition Failed";
+		goto outstatus;
+	}
+#endif
+
+	if (!r->upart) {
+		r->status = "501 Not Implemented";
+		ESP_LOGE(TAG, "No OTA part available!");
+		r->ret = ESP_ERR_NOT_SUPPORTED;
+		goto outstatus;
+	}
+
+	ESP_LOGI(TAG, "target OTA part %s subtype %#x addr %#" PRIx32, r->upart->label, r->upart->subtype, r->upart->address);
+
+	if (r->hp.chunked) {
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHUNKED
+		// Content-Length must be ignored, the body ends with the last chunk
+		b->k.state = CHUNK_SIZE;
+		r->binlen = INT_MAX;
+#else
+		r->status = "501 Not Implemented";
+		goto outstatus;
+#endif
+	}
+	else {
+		r->binlen = r->hp.clen;
+		if (r->binlen <= 0) {
+			r->status = "411 Length Required";
+			goto outstatus;
+		}
+	}
+
+	b->w.part = r->upart;
+	b->w.imglen = r->hp.chunked ? OTA_SIZE_UNKNOWN : r->binlen;
+	b->w.cfg = cfg;
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_BENCH
+	if (!strncmp(buf, "POST /bench", 11) && (buf[11] == ' ' || buf[11] == '?')) {
+		r->bench = strncmp(buf + 11, "?flash", 6) ? BENCH_NET : BENCH_FLASH;
+		b->w.cfg = &ota_nocb_cfg;	// not an update: no callbacks
+		ESP_LOGI(TAG, "Benchmark (%s)", (r->bench == BENCH_FLASH) ? "network and flash" : "network");
+		// don't overwrite an update pending reboot
+		if (r->bench == BENCH_FLASH && r->upart == esp_ota_get_boot_partition()) {
+			ESP_LOGE(TAG, "Update partition is the boot partition");
+			r->status = "409 Conflict";
+			goto outstatus;
+		}
+	}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_INFLATE
+	hdr = r->hp.hv[HDR_CONTENT_ENCODING];
+	if (hdr && strncmp(hdr, "identity", 8)) {
+		if (strncmp(hdr, "gzip", 4) && strncmp(hdr, "deflate", 7)) {
+			r->status = "415 Unsupported Media Type";
+			goto outstatus;
+		}
+		b->z = ota_inflate_init(!strncmp(hdr, "gzip", 4));
+		if (!b->z) {
+			ESP_LOGE(TAG, "Out of memory for inflate");
+			r->ret = ESP_ERR_NO_MEM;
+			goto outstatus;
+		}
+		hdr = r->hp.hv[HDR_DECOMPRESSED_LENGTH];
+		b->w.imglen = hdr ? strtol(hdr, NULL, 10) : 0;
+		if (!b->w.imglen)
+			b->w.imglen = OTA_SIZE_UNKNOWN;
+		if (!r->hp.chunked)
+			ESP_LOGI(TAG, "Compressed size: %d bytes", r->binlen);
+	}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_DELTA
+	if (!strncmp(buf, "POST /delta", 11) && (buf[11] == ' ' || buf[11] == '?')) {
+		b->d = ota_delta_init(!b->z);
+		if (!b->d) {
+			ESP_LOGE(TAG, "Out of memory for delta");
+			r->ret = ESP_ERR_NO_MEM;
+			goto outstatus;
+		}
+		b->w.imglen = OTA_SIZE_UNKNOWN;	// provided by the patch header
+		ESP_LOGI(TAG, "Patching from %s", b->d->old->label);
+	}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+	if (r->put) {
+		// ranged upload of a raw image, possibly one of several in parallel
+		hdr = r->hp.hv[HDR_CONTENT_RANGE];
+		if (!hdr || r->hp.chunked || b->z || b->d) {
+			r->status = "400 Bad Request";
+			goto outstatus;
+		}
+		r->status = ota_sess_claim(hdr, r->binlen, r->upart, &r->first, &r->total);
+		if (r->status)
+			goto outstatus;
+		r->status = "500 Internal Server Error";
+		r->ranged = true;
+		r->rlen = r->binlen;
+		r->keepalive = ota_keepalive(buf, &r->hp);
+		b->w.cfg = &ota_nocb_cfg;	// the session reports progress
+		b->w.start = r->first;
+		b->w.imglen = r->total;
+		ESP_LOGI(TAG, "Range %zu-%zu/%zu", r->first, r->first + r->rlen - 1, r->total);
+		goto body;
+	}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_RESUME
+	hdr = r->hp.hv[HDR_CONTENT_RANGE];
+	if (hdr) {
+		uint32_t resume;
+
+		if (b->z || b->d || r->hp.chunked) {	// ranges are only meaningful for raw images of known length
+			r->status = "400 Bad Request";
+			goto outstatus;
+		}
+		if (ota_resume_check(&b->w, hdr, r->binlen, &resume) != ESP_OK) {
+			ota_respond(conn, buf, OTA_BUFSIZE, "416 Range Not Satisfiable", false, "Resume offset: %" PRIu32 "\n", resume);
+			goto out;
+		}
+		if (b->w.start)
+			ESP_LOGI(TAG, "Resuming from offset %zu", b->w.start);
+	}
+#endif
+
+	if (b->w.imglen != OTA_SIZE_UNKNOWN)
+		ESP_LOGI(TAG, "Image size: %zu bytes", b->w.imglen);
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_DIGEST
+	switch (ota_digest(&r->hp, r->digest)) {
+	case 1:
+		b->w.digest = true;
+		mbedtls_sha256_init(&b->w.sha);
+		mbedtls_sha256_starts(&b->w.sha, 0);
+ #ifdef CONFIG_SIMPLE_PUSHOTA_RESUME
+		// the digest covers the whole image, including the part already written
+		if (ota_part_sha256(&b->w.sha, r->upart, b->w.start) != ESP_OK)
+			goto outstatus;
+ #endif
+		break;
+	case -1:
+		r->status = "400 Bad Request";
+		goto outstatus;
+	}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_BENCH
+	if (r->bench == BENCH_NET) {
+		// receive and discard the payload
+		*binstart = c;
+		b->w.st.received = len;
+ #ifdef CONFIG_SIMPLE_PUSHOTA_CHUNKED
+		if (ota_chunked(&b->k, binstart, len) < 0)
+			goto outstatus;
+ #endif
+		r->binlen = ota_body_left(b, r->binlen, len);
+		goto started;
+	}
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+	if (!ota_sess_update()) {
+		r->status = "409 Conflict";	// another upload is in progress
+		goto outstatus;
+	}
+	r->update = true;
+body:
+#endif
+
+	if (ota_wr_start(&b->w, buf) != ESP_OK)
+		goto failota;
+
+	// write leftover buf pertaining to app image
+	*binstart = c;
+	if (len) {
+		s = ota_body_get(b, &size);	// size >= len on the first call
+		if (!s)
+			goto failota;
+		memmove(s, binstart, len);
+		if (ota_body_put(b, s, len) != ESP_OK)
+			goto failota;
+		r->binlen = ota_body_left(b, r->binlen, len);
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+		b->w.st.received += len;
+#endif
+	}
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_BENCH
+started:
+#endif
+	r->state = REQ_BODY;
+	if (!r->binlen)
+		ota_req_end(conn, r, END_BODY);
+	return;
+
+#if defined(CONFIG_SIMPLE_PUSHOTA_EXPORT) || defined(CONFIG_SIMPLE_PUSHOTA_GETVERSION)
+done:
+	r->state = REQ_DONE;	// nothing to release
+	return;
+#endif
+failota:
+	ota_req_end(conn, r, END_FAIL);
+	return;
+outstatus:
+	ota_req_end(conn, r, END_STATUS);
+	return;
+#ifdef CONFIG_SIMPLE_PUSHOTA_RESUME
+out:
+	ota_req_end(conn, r, END_OUT);
+#endif
+}
+
+/**
+ * Receive request headers, at most once, and process them once complete.
+ * @param conn the client connection
+ * @param r the request, receiving its headers
+ * @return false if no data was available on a non-blocking connection
+ */
+static bool ota_req_headers(struct ota_conn *conn, struct ota_req *r)
+{
+	char *s = r->buf + r->fill, *binstart;
+	int len = r->unparsed;
+
+	// start with data already received on a persistent connection, if any
+	if (len)
+		r->unparsed = 0;
+	else {
+		// the request line and the kept headers must fit the buffer
+		if (r->fill >= OTA_BUFSIZE-1) {	// keep room for the null termination
+			r->status = "431 Request Header Fields Too Large";
+			ota_req_end(conn, r, END_STATUS);
+			return true;
+		}
+		len = ota_recv(conn, s, OTA_BUFSIZE-1 - r->fill);
+		if (len == OTA_AGAIN)
+			return false;
+		if (len <= 0) {
+			r->state = REQ_DONE;
+			return true;
+		}
+	}
+	binstart = ota_hparse(&r->hp, s, len);
+	r->fill = r->hp.end - r->buf;	// less any dropped header lines
+	if (binstart)
+		ota_req_start(conn, r, binstart);
+
+	return true;
+}
+
+/**
+ * Receive request body data, at most once, and process it.
+ * @param conn the client connection
+ * @param r the request, receiving its body
+ * @return false if no data was available on a non-blocking connection
+ */
+static bool ota_req_body(struct ota_conn *conn, struct ota_req *r)
+{
+	struct ota_body *b = &r->b;
+	char *s;
+	int len, size;
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	int64_t t;
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_BENCH
+	if (r->bench == BENCH_NET) {
+		// receive and discard the payload
+		t = esp_timer_get_time();
+		len = ota_recv(conn, r->buf, (OTA_BUFSIZE < r->binlen) ? OTA_BUFSIZE : r->binlen);
+		if (len == OTA_AGAIN)
+			return false;
+		ota_stats_recv(&b->w.st, t, len);
+		if (len <= 0
+ #ifdef CONFIG_SIMPLE_PUSHOTA_CHUNKED
+		    || ota_chunked(&b->k, r->buf, len) < 0
+ #endif
+		    )
+			goto end;
+		r->binlen = ota_body_left(b, r->binlen, len);
+		if (r->binlen)
+			return true;
+		goto end;
+	}
+#endif
+
+#ifdef OTA_ZEROCOPY
+	if (!b->z && !b->d) {
+		// hand received data over to flash without copying it
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+		t = esp_timer_get_time();
+#endif
+		len = ota_recv_ref(conn, &s, r->binlen);
+		if (len == OTA_AGAIN)
+			return false;
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+		ota_stats_recv(&b->w.st, t, len);
+#endif
+		if (len < 0)
+			goto failota;
+		if (!len)	// EOF
+			goto end;
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHUNKED
+		size = ota_chunked(&b->k, s, len);	// we own the received data
+		if (size < 0)
+			goto failota;
+#else
+		size = len;
+#endif
+		if (size && ota_wr_direct(&b->w, s, size) != ESP_OK)
+			goto failota;
+
+		r->binlen = ota_body_left(b, r->binlen, len);
+		if (r->binlen)
+			return true;
+		goto end;
+	}
+#endif
+	s = ota_body_get(b, &size);
+	if (!s)
+		goto failota;
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	t = esp_timer_get_time();
+#endif
+	len = ota_recv(conn, s, (size < r->binlen) ? size : r->binlen);
+	if (len == OTA_AGAIN)
+		return false;
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	ota_stats_recv(&b->w.st, t, len);
+#endif
+	if (len < 0)
+		goto failota;
+	if (!len)	// EOF
+		goto end;
+
+	if (ota_body_put(b, s, len) != ESP_OK)
+		goto failota;
+
+	r->binlen = ota_body_left(b, r->binlen, len);
+
+	// loop until we receive the full image
+	if (r->binlen)
+		return true;
+end:
+	ota_req_end(conn, r, END_BODY);
+	return true;
+
+failota:
+	ota_req_end(conn, r, END_FAIL);
+	return true;
+}
+
+/**
+ * Advance a request by receiving data at most once.
+ * @param conn the client connection
+ * @param r the request, not done yet
+ * @return false if no data was available on a non-blocking connection
+ */
+static bool ota_req_step(struct ota_conn *conn, struct ota_req *r)
+{
+	return (r->state == REQ_HEADERS) ? ota_req_headers(conn, r) : ota_req_body(conn, r);
+}
+
+/**
+ * Give up on a request, e.g. on receive timeout.
+ * An update in progress fails as if the connection had been closed.
+ * @param conn the client connection
+ * @param r the request, not done yet
+ */
+static void ota_req_abort(struct ota_conn *conn, struct ota_req *r)
+{
+	if (r->state == REQ_BODY)
+		ota_req_end(conn, r, END_FAIL);
+	r->state = REQ_DONE;
+	r->pending = -1;
+}
+
+/**
+ * Perform OTA firmware update.
+ * Parse basic HTTP requests containing either:
+ * - POST request with:
+ *  - Header "Content-Length": binary image size, or (if enabled via CONFIG_SIMPLE_PUSHOTA_CHUNKED)
+ *    header "Transfer-Encoding": "chunked", for a chunked payload of unknown size
+ *  - Optional header "Content-Encoding" (if enabled via CONFIG_SIMPLE_PUSHOTA_INFLATE): "gzip" or "deflate",
+ *    with optional header "X-Decompressed-Length": uncompressed image size
+ *  - Optional header "Content-Range" (if enabled via CONFIG_SIMPLE_PUSHOTA_RESUME): "bytes N-[M/TOTAL]",
+ *    to resume an interrupted upload of a raw image from offset N
+ *  - Optional header "X-SHA256" or "Digest" (if enabled via CONFIG_SIMPLE_PUSHOTA_DIGEST): expected image hash
+ *  - Payload: raw binary image, or patch if the request targets "/delta"
+ *    (if enabled via CONFIG_SIMPLE_PUSHOTA_DELTA)
+ * - POST request to "/bench" (if enabled via CONFIG_SIMPLE_PUSHOTA_BENCH), whose payload is discarded,
+ *   or to "/bench?flash", whose payload is written to the update partition without setting it as boot partition
+ * - PUT request (if enabled via CONFIG_SIMPLE_PUSHOTA_PARALLEL) with headers "Content-Length" and
+ *   "Content-Range": "bytes FIRST-LAST/TOTAL", whose payload is a sector aligned part of a raw image
+ * - DELETE request with no content to abort the OTA process
+ * - GET request (if enabled via CONFIG_SIMPLE_PUSHOTA_GETVERSION) to query the current firmware version
+ * - GET request to "/partition/<label>" (if enabled via CONFIG_SIMPLE_PUSHOTA_EXPORT) to read a partition back
+ * Only GET and PUT requests may be followed by further requests on the same (persistent) connection.
+ * The request is processed by ota_req_step() until done, which pushota_server_poll() does one step at a time.
+ * @param conn accept()'d input connection
+ * @param buf a work buffer of OTA_BUFSIZE bytes
+ * @param pending on input, the amount of request data already received at the start of buf;
+ * on return, -1 if the connection must be closed, or the amount of data received for the next request.
+ * @param cfg the configuration, for callbacks and statistics
+ * @return execution status: it is safe to call esp_restart() after this returns ESP_OK
+ */
+static int ota_receive(struct ota_conn *conn, char *buf, int *pending, const pushota_config_t *cfg)
+{
+	struct ota_req r;
+
+	ota_req_init(&r, buf, *pending, cfg);
+	while (r.state != REQ_DONE)
+		ota_req_step(conn, &r);
+
+	*pending = r.pending;
+	return r.ret;
+}
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_MULTICAST
+/** Multicast packet types */
+enum {
+	MCAST_DATA,	///< image block, arg is the block number
+	MCAST_POLL,	///< end of a sender pass, arg is the block count: receivers missing blocks reply with a NACK
+	MCAST_NACK,	///< missing block ranges (pairs of first block and count), arg is the number of ranges
+};
+
+/** Multicast packet header, MCAST_HDRLEN long, all fields in network byte order */
+struct ota_mcast_hdr {
+	uint32_t magic;			///< MCAST_MAGIC
+	uint8_t type;
+	uint8_t reserved;
+	uint16_t blksize;		///< block size, all blocks but the last one are full
+	uint32_t session;		///< session identifier, chosen by the sender
+	uint32_t size;			///< image size
+	uint32_t arg;
+} __attribute__((packed));
+
+/**
+ * Setup the multicast receive socket.
+ * @param cfg the configuration
+ * @return the socket or -1 on error
+ */
+static int ota_mcast_open(const pushota_config_t *cfg)
+{
+	struct sockaddr_in addr = { 0 };
+	struct ip_mreq mreq = { 0 };
+	int sock;
+
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(cfg->port);
+
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	if (cfg->bind_addr && *cfg->bind_addr && !inet_aton(cfg->bind_addr, &mreq.imr_interface)) {
+		ESP_LOGE(TAG, "Invalid bind address: %s", cfg->bind_addr);
+		return -1;
+	}
+	if (!inet_aton(CONFIG_SIMPLE_PUSHOTA_MULTICAST_GROUP, &mreq.imr_multiaddr)) {
+		ESP_LOGE(TAG, "Invalid multicast group: %s", CONFIG_SIMPLE_PUSHOTA_MULTICAST_GROUP);
+		return -1;
+	}
+
+	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock < 0) {
+		ESP_LOGE(TAG, "socket(): %s", strerror(errno));
+		return -1;
+	}
+
+#ifdef CONFIG_LWIP_SO_REUSE
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
+#endif
+
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		ESP_LOGE(TAG, "bind(): %s", strerror(errno));
+		goto fail;
+	}
+
+	if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq))) {
+		ESP_LOGE(TAG, "IP_ADD_MEMBERSHIP: %s", strerror(errno));
+		goto fail;
+	}
+
+	if (cfg->rcvbuf) {
+#ifdef CONFIG_LWIP_SO_RCVBUF
+		if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &cfg->rcvbuf, sizeof(int)))
+			ESP_LOGW(TAG, "SO_RCVBUF: %d", errno);
+#else
+		ESP_LOGW(TAG, "Warning: SO_RCVBUF is not available!");
+#endif
+	}
+
+	ESP_LOGI(TAG, "Multicast group %s port %d", CONFIG_SIMPLE_PUSHOTA_MULTICAST_GROUP, cfg->port);
+
+	return sock;
+
+fail:
+	close(sock);
+	return -1;
+}
+
+/**
+ * Report missing blocks to the sender.
+ * The reply is delayed by a random amount of time, to avoid all receivers replying at once.
+ * @param sock the multicast socket
+ * @param buf the packet buffer, OTA_BUFSIZE long
+ * @param to the sender address
+ * @param h the header of the poll packet
+ * @param m the block map
+ */
+static void ota_mcast_nack(int sock, char *buf, const struct sockaddr_in *to, struct ota_mcast_hdr *h, const struct ota_blkmap *m)
+{
+	size_t first, count, from = 0;
+	uint32_t range[2];
+	int n;
+
+	for (n = 0; n < MCAST_MAX_RANGES; n++) {
+		first = ota_blkmap_next(m, from, &count);
+		if (!count)
+			break;
+		range[0] = htonl(first);
+		range[1] = htonl(count);
+		memcpy(buf + MCAST_HDRLEN + n * sizeof(range), range, sizeof(range));
+		from = first + count;
+	}
+
+	h->type = MCAST_NACK;
+	h->arg = htonl(n);
+	memcpy(buf, h, MCAST_HDRLEN);
+
+	vTaskDelay(pdMS_TO_TICKS(esp_random() % MCAST_NACK_SPREAD));
+	if (sendto(sock, buf, MCAST_HDRLEN + n * sizeof(range), 0, (const struct sockaddr *)to, sizeof(*to)) < 0)
+		ESP_LOGW(TAG, "sendto(): %d", errno);
+}
+
+/**
+ * Setup a multicast update: blocks arrive in any order, so the whole image range is erased upfront.
+ * @param w the write context, with the image size set
+ * @return execution status
+ */
+static esp_err_t ota_mcast_begin(struct ota_wctx *w)
+{
+	size_t n = (w->imglen + OTA_SECTOR_SIZE - 1) & ~(OTA_SECTOR_SIZE - 1);
+	esp_err_t ret;
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	int64_t start = esp_timer_get_time();
+#endif
+
+	ret = ota_wr_begin(w);
+	if (ret != ESP_OK)
+		return ret;
+
+	// unless already done
+	ret = (w->erased < n) ? esp_partition_erase_range(w->part, w->erased, n - w->erased) : ESP_OK;
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	w->st.begin_us = esp_timer_get_time() - start;
+#endif
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "Erase: %s", esp_err_to_name(ret));
+		return ret;
+	}
+	w->erased = w->part->size;
+
+	return ESP_OK;
+}
+
+/**
+ * Perform OTA firmware update from a multicast stream.
+ * The first valid packet starts a session, whose blocks are then written in any order
+ * through the partition API to the target partition, erased upfront. Packets from other
+ * sessions are ignored. The update completes as soon as all blocks have been received.
+ * With CONFIG_SIMPLE_PUSHOTA_CHECK_IMAGE, nothing is erased nor written until block 0
+ * has been received and checked: blocks received before are dropped, to be requested again.
+ * @param sock the multicast socket
+ * @param buf the packet buffer, OTA_BUFSIZE long
+ * @param cfg the configuration
+ * @return execution status
+ */
+static esp_err_t ota_mcast_receive(int sock, char *buf, const pushota_config_t *cfg)
+{
+	const esp_partition_t *upart = esp_ota_get_next_update_partition(NULL);
+	struct ota_wctx w = { .part = upart, .cfg = cfg };
+	struct ota_blkmap m = { .bits = NULL };
+	struct ota_mcast_hdr h;
+	struct sockaddr_in src;
+	socklen_t srclen;
+	struct timeval tv = { .tv_sec = cfg->rcv_timeout ? cfg->rcv_timeout : MCAST_TIMEOUT };
+	uint32_t session = 0, ignored = 0;
+	size_t blksize = 0, n, off;
+	esp_err_t ret = ESP_FAIL;
+	int len;
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	int64_t start = 0, t = 0;
+#endif
+
+	if (!upart) {
+		ESP_LOGE(TAG, "No OTA part available!");
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+
+	ESP_LOGI(TAG, "target OTA part %s subtype %#x addr %#" PRIx32, upart->label, upart->subtype, upart->address);
+
+	while (!m.bits || m.missing) {
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+		if (m.bits)
+			t = esp_timer_get_time();
+#endif
+		srclen = sizeof(src);
+		len = recvfrom(sock, buf, OTA_BUFSIZE, 0, (struct sockaddr *)&src, &srclen);
+		if (len < 0) {
+			ESP_LOGE(TAG, "Multicast session timed out");
+			ret = ESP_ERR_TIMEOUT;
+			goto out;
+		}
+		if (len < MCAST_HDRLEN)
+			continue;
+
+		memcpy(&h, buf, MCAST_HDRLEN);
+		if (ntohl(h.magic) != MCAST_MAGIC || h.type == MCAST_NACK)
+			continue;
+
+		if (!m.bits) {
+			// first packet: setup the session
+			blksize = ntohs(h.blksize);
+			w.imglen = ntohl(h.size);
+			if (!blksize || blksize % MCAST_BLKALIGN || blksize > OTA_BUFSIZE - MCAST_HDRLEN || !w.imglen
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHECK_IMAGE
+			    || blksize < OTA_CHECK_LEN	// block 0 must hold the whole check
+#endif
+			    ) {
+				if (ignored != h.session)
+					ESP_LOGW(TAG, "Ignoring session %#" PRIx32 " (block size %zu)", ntohl(h.session), blksize);
+				ignored = h.session;
+				continue;
+			}
+			session = h.session;
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+			t = start = esp_timer_get_time();
+#endif
+			if (cfg->conn_cb) {
+				ESP_LOGD(TAG, "running conn_cb");
+				cfg->conn_cb();
+			}
+
+			ESP_LOGI(TAG, "Session %#" PRIx32 ", image size: %zu bytes", ntohl(session), w.imglen);
+
+			ret = ota_blkmap_init(&m, (w.imglen + blksize - 1) / blksize);
+			if (ret != ESP_OK) {
+				ESP_LOGE(TAG, "Out of memory");
+				goto out;
+			}
+
+#ifndef CONFIG_SIMPLE_PUSHOTA_CHECK_IMAGE
+			ret = ota_mcast_begin(&w);
+			if (ret != ESP_OK)
+				goto out;
+#endif
+
+			if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) {
+				ESP_LOGE(TAG, "SO_RCVTIMEO: %d", errno);
+				ret = ESP_FAIL;
+				goto out;
+			}
+		}
+
+		if (h.session != session)
+			continue;
+
+		if (h.type == MCAST_POLL) {
+			ota_mcast_nack(sock, buf, &src, &h, &m);
+			continue;
+		}
+
+		if (h.type != MCAST_DATA)
+			continue;
+
+		len -= MCAST_HDRLEN;
+		n = ntohl(h.arg);
+		off = n * blksize;
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+		ota_stats_recv(&w.st, t, len);
+#endif
+		if (n >= m.nblocks || len != ((w.imglen - off < blksize) ? w.imglen - off : blksize))
+			continue;
+		if (ota_blkmap_get(&m, n))	// duplicate
+			continue;
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_CHECK_IMAGE
+		if (!w.begun) {
+			// check the image before anything is erased
+			if (n)
+				continue;
+			ret = ota_wr_check(&w, buf + MCAST_HDRLEN, len);
+			if (ret == ESP_OK)
+				ret = ota_mcast_begin(&w);
+			if (ret != ESP_OK)
+				goto out;
+		}
+#endif
+
+		w.offset = off;
+		ret = ota_wr_flash(&w, buf + MCAST_HDRLEN, len);
+		if (ret != ESP_OK) {
+			ESP_LOGE(TAG, "Write: %s", esp_err_to_name(ret));
+			goto out;
+		}
+		ota_blkmap_set(&m, n);
+		ota_wr_progress(&w, len);
+	}
+
+	ret = ota_wr_end(&w);
+	if (ret != ESP_OK)
+		goto out;
+
+	ESP_LOGI(TAG, "Flash complete");
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	t = esp_timer_get_time();
+#endif
+	ret = esp_ota_set_boot_partition(upart);
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	w.st.boot_us = esp_timer_get_time() - t;
+	ota_stats_end(&w.st, start);
+#endif
+	if (ret == ESP_OK)
+		ESP_LOGI(TAG, "Next boot partition: %s", upart->label);
+#ifdef CONFIG_SIMPLE_PUSHOTA_FANOUT
+	if (ret == ESP_OK) {
+		ota_last.part = upart;
+		ota_last.len = w.imglen;
+	}
+#endif
+
+out:
+	ota_wr_abort(&w);
+	if (w.notified) {
+		if (ret == ESP_OK) {
+			if (cfg->end_cb)
+				cfg->end_cb(cfg->cb_arg);
+		}
+		else if (cfg->fail_cb)
+			cfg->fail_cb(cfg->cb_arg, ret);
+	}
+#ifdef CONFIG_SIMPLE_PUSHOTA_STATS
+	if (cfg->stats && m.bits) {
+		if (!w.st.total_us)	// failed
+			ota_stats_end(&w.st, start);
+		*cfg->stats = w.st;
+	}
+#endif
+	heap_caps_free(m.bits);
+	return ret;
+}
+#endif /* CONFIG_SIMPLE_PUSHOTA_MULTICAST */
+
+/**
+ * Serve requests on an accepted connection, until the client closes or the connection must not be kept open.
+ * @param conn the connection, closed on return
+ * @param cfg the configuration
+ * @param buf a receive buffer of OTA_BUFSIZE bytes from the heap, freed on return,
+ * or NULL to allocate one (always NULL when the receive buffer is on the stack)
+ * @return execution status of the last request
+ */
+static esp_err_t ota_serve(struct ota_conn *conn, const pushota_config_t *cfg, char *buf)
+{
+	int pending, ret;
+#if OTA_BOOST_PRIO
+	UBaseType_t prio = uxTaskPriorityGet(NULL);
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_BUF_STACK
+	char sbuf[OTA_BUFSIZE];
+
+	buf = sbuf;
+#endif
+
+#if OTA_BOOST_PRIO
+	// raised for the duration of the connection, so that the writer task is created boosted too
+	if (prio < OTA_BOOST_PRIO)
+		vTaskPrioritySet(NULL, OTA_BOOST_PRIO);
+#endif
+
+	ret = ota_conn_opts(conn, cfg);
+	if (ret != ESP_OK)
+		goto out;
+
+#ifndef CONFIG_SIMPLE_PUSHOTA_BUF_STACK
+	if (!buf)
+		buf = heap_caps_malloc(OTA_BUFSIZE, OTA_MALLOC_CAPS);
+	if (!buf) {
+		ESP_LOGE(TAG, "Out of memory");
+		ret = ESP_ERR_NO_MEM;
+		goto out;
+	}
+#endif
+
+	pending = 0;
+	do {
+		ret = ota_receive(conn, buf, &pending, cfg);
+	} while (pending > 0 || (!pending && ota_wait(conn, HTTP_IDLE_TIMEOUT)));
+
+out:
+#ifndef CONFIG_SIMPLE_PUSHOTA_BUF_STACK
+	heap_caps_free(buf);
+#endif
+	ota_close(conn);
+#if OTA_BOOST_PRIO
+	if (prio < OTA_BOOST_PRIO)
+		vTaskPrioritySet(NULL, prio);
+#endif
+
+	return ret;
+}
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+/** Connection handed over to a worker task */
+struct ota_job {
+	struct ota_conn conn;		///< accepted connection
+	char *buf;			///< receive buffer, see ota_serve()
+};
+
+/**
+ * Connection worker task.
+ * @param arg the job, allocated by ota_parallel()
+ */
+static void ota_worker(void *arg)
+{
+	struct ota_job *job = arg;
+	esp_err_t ret;
+
+	ret = ota_serve(&job->conn, ota_sess.cfg, job->buf);
+	heap_caps_free(job);
+
+	xSemaphoreTake(ota_sess.lock, portMAX_DELAY);
+	if (ota_sess.ret != ESP_OK)	// keep the update outcome, if any
+		ota_sess.ret = ret;
+	ota_sess.conns--;
+	xSemaphoreGive(ota_sess.lock);
+
+	xSemaphoreGive(ota_sess.exits);
+	vTaskDelete(NULL);
+}
+
+/**
+ * Serve up to OTA_PAR_CONNS connections in parallel, each in its own task.
+ * Stops accepting connections once an update has completed, or once all connections are closed and
+ * either no ranged upload is in progress or no connection has been made for HTTP_IDLE_TIMEOUT,
+ * then returns when all connections are closed.
+ * @param lsock the listening connection
+ * @param cfg the configuration
+ * @param wait how long to wait (ms) for the first connection, 0 to wait forever
+ * @return execution status: ESP_OK if an update has completed, ESP_ERR_TIMEOUT if no connection was made
+ */
+static esp_err_t ota_parallel(ota_listener_t lsock, const pushota_config_t *cfg, int wait)
+{
+	struct ota_job *job = NULL;
+	bool started = false, done;
+	int idle = 0, conns;
+	esp_err_t ret = ESP_FAIL;
+
+	if (!ota_sess.exits) {
+		ota_sess.exits = xSemaphoreCreateCounting(OTA_PAR_CONNS, 0);
+		if (!ota_sess.exits)
+			return ESP_ERR_NO_MEM;
+	}
+
+	// exits are only wakeups, the connection count is what matters: forget those left from the previous call
+	while (xSemaphoreTake(ota_sess.exits, 0) == pdTRUE)
+		;
+
+	ota_sess.cfg = cfg;
+	ota_sess.ret = ESP_FAIL;
+	ota_sess.conns = 0;
+
+	if (wait)
+		ota_listen_timeout(lsock, wait);
+
+	for (;;) {
+		xSemaphoreTake(ota_sess.lock, portMAX_DELAY);
+		done = (ota_sess.ret == ESP_OK) ||	// updated, don't take further connections
+		       (started && !ota_sess.conns && (!ota_sess.imglen || idle >= HTTP_IDLE_TIMEOUT * 1000));
+		xSemaphoreGive(ota_sess.lock);
+		if (done)
+			break;
+
+		if (!job) {
+			job = heap_caps_malloc(sizeof(*job), OTA_MALLOC_CAPS);
+			if (!job) {
+				ESP_LOGE(TAG, "Out of memory");
+				ret = ESP_ERR_NO_MEM;
+				break;
+			}
+		}
+
+		ret = ota_accept(lsock, &job->conn);
+		if (ret == ESP_ERR_TIMEOUT && started) {
+			idle += OTA_PAR_POLL;
+			continue;
+		}
+		if (ret != ESP_OK)
+			break;
+
+		if (!started) {
+			if (cfg->conn_cb) {
+				ESP_LOGD(TAG, "running conn_cb");
+				cfg->conn_cb();
+			}
+			ota_listen_timeout(lsock, OTA_PAR_POLL);	// from now on, check regularly whether we're done
+			started = true;
+		}
+		idle = 0;
+
+#ifdef OTA_PREP_BUF
+		job->buf = ota_prep.buf;	// the first connection gets the reserved buffer, if any
+		ota_prep.buf = NULL;
+#else
+		job->buf = NULL;
+#endif
+
+		xSemaphoreTake(ota_sess.lock, portMAX_DELAY);
+		conns = ++ota_sess.conns;
+		xSemaphoreGive(ota_sess.lock);
+
+		if (xTaskCreatePinnedToCore(ota_worker, "ota_worker", OTA_PAR_STACK, job, uxTaskPriorityGet(NULL), NULL, OTA_NET_CORE) != pdPASS) {
+			ESP_LOGE(TAG, "Failed to create worker task");
+			heap_caps_free(job->buf);
+			ota_close(&job->conn);
+			xSemaphoreTake(ota_sess.lock, portMAX_DELAY);
+			conns = --ota_sess.conns;
+			xSemaphoreGive(ota_sess.lock);
+		}
+		else
+			job = NULL;	// now owned by the worker
+
+		// leave further connections in the backlog until a worker is available
+		while (conns >= OTA_PAR_CONNS) {
+			xSemaphoreTake(ota_sess.exits, portMAX_DELAY);
+			xSemaphoreTake(ota_sess.lock, portMAX_DELAY);
+			conns = ota_sess.conns;
+			xSemaphoreGive(ota_sess.lock);
+		}
+	}
+
+	heap_caps_free(job);
+
+	// wait for the remaining workers
+	for (;;) {
+		xSemaphoreTake(ota_sess.lock, portMAX_DELAY);
+		conns = ota_sess.conns;
+		xSemaphoreGive(ota_sess.lock);
+		if (!conns)
+			break;
+		xSemaphoreTake(ota_sess.exits, portMAX_DELAY);
+	}
+
+	if (started || wait)
+		ota_listen_timeout(lsock, 0);
+
+	return started ? ota_sess.ret : ret;
+}
+#endif /* CONFIG_SIMPLE_PUSHOTA_PARALLEL */
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_FANOUT
+/**
+ * Send data on a socket.
+ * @param sock the socket
+ * @param data the data to send
+ * @param len the data length
+ * @return execution status
+ */
+static esp_err_t ota_fanout_send(int sock, const char *data, int len)
+{
+	int n;
+
+	for (; len; len -= n, data += n) {
+		n = send(sock, data, len, 0);
+		if (n <= 0) {
+			ESP_LOGE(TAG, "send(): %s", strerror(errno));
+			return ESP_FAIL;
+		}
+	}
+
+	return ESP_OK;
+}
+
+/**
+ * Push the last written image to a peer.
+ * @param peer the peer address, "host" or "host:port"
+ * @param hash the image hash header, or an empty string
+ * @param buf a work buffer of OTA_BUFSIZE bytes
+ * @param cfg the configuration
+ * @return execution status
+ */
+static esp_err_t ota_fanout_peer(const char *peer, const char *hash, char *buf, const pushota_config_t *cfg)
+{
+	const struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+	struct timeval tv = { .tv_sec = cfg->rcv_timeout ? cfg->rcv_timeout : OTA_FANOUT_TIMEOUT };
+	struct addrinfo *res = NULL;
+	char host[64], port[8];
+	esp_err_t ret = ESP_FAIL;
+	const char *s;
+	size_t off;
+	int sock, n, status;
+
+	s = strrchr(peer, ':');
+	n = s ? s - peer : strlen(peer);
+	if (n >= sizeof(host)) {
+		ESP_LOGE(TAG, "Invalid peer: %s", peer);
+		return ESP_ERR_INVALID_ARG;
+	}
+	memcpy(host, peer, n);
+	host[n] = '\0';
+	snprintf(port, sizeof(port), "%d", s ? atoi(s + 1) : cfg->port);
+
+	if (getaddrinfo(host, port, &hints, &res) || !res) {
+		ESP_LOGE(TAG, "%s: cannot resolve", peer);
+		return ESP_FAIL;
+	}
+
+	sock = socket(res->ai_family, res->ai_socktype, 0);
+	if (sock < 0) {
+		ESP_LOGE(TAG, "socket(): %s", strerror(errno));
+		goto out;
+	}
+
+	// a stalled or vanished peer must not hold up the rest of the rollout
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+	    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv))) {
+		ESP_LOGE(TAG, "SO_RCVTIMEO/SO_SNDTIMEO: %d", errno);
+		goto out;
+	}
+	if (cfg->keepalive_idle) {
+		if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &(int){ 1 }, sizeof(int))) {
+			ESP_LOGE(TAG, "SO_KEEPALIVE: %d", errno);
+			goto out;
+		}
+		// assume cannot fail if the above succeeds
+		setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &cfg->keepalive_idle, sizeof(int));
+		setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &cfg->keepalive_interval, sizeof(int));
+		setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &cfg->keepalive_count, sizeof(int));
+	}
+
+	if (connect(sock, res->ai_addr, res->ai_addrlen)) {
+		ESP_LOGE(TAG, "%s: connect(): %s", peer, strerror(errno));
+		goto out;
+	}
+
+	ESP_LOGI(TAG, "Pushing %zu bytes to %s", ota_last.len, peer);
+
+	n = snprintf(buf, OTA_BUFSIZE, "POST / HTTP/1.1\r\nHost: %s\r\nContent-Type: application/octet-stream\r\n"
+		     "Content-Length: %zu\r\n%sConnection: close\r\n\r\n", host, ota_last.len, hash);
+	if (ota_fanout_send(sock, buf, n) != ESP_OK)
+		goto out;
+
+	for (off = 0; off < ota_last.len; off += n) {
+		n = (ota_last.len - off < OTA_BUFSIZE) ? ota_last.len - off : OTA_BUFSIZE;
+		if (esp_partition_read(ota_last.part, off, buf, n) != ESP_OK || ota_fanout_send(sock, buf, n) != ESP_OK)
+			goto out;
+	}
+
+	// the status line is all we need
+	n = recv(sock, buf, OTA_BUFSIZE - 1, 0);
+	if (n <= 0) {
+		ESP_LOGE(TAG, "%s: no response", peer);
+		goto out;
+	}
+	buf[n] = '\0';
+
+	if (sscanf(buf, "HTTP/%*d.%*d %d", &status) != 1 || status != 200) {
+		ESP_LOGE(TAG, "%s: update failed: %.*s", peer, (int)strcspn(buf, "\r\n"), buf);
+		goto out;
+	}
+
+	ESP_LOGI(TAG, "%s updated", peer);
+	ret = ESP_OK;
+
+out:
+	if (sock >= 0)
+		close(sock);
+	freeaddrinfo(res);
+	return ret;
+}
+#endif /* CONFIG_SIMPLE_PUSHOTA_FANOUT */
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PREPARE
+/**
+ * Reserve resources for the next update while waiting for a connection, unless already done:
+ * resolve the target partition, allocate the receive buffer and erase the first sectors of the partition.
+ * Failures are not fatal, the resources are then set up as usual once the request arrives.
+ */
+static void ota_prepare(void)
+{
+#ifdef OTA_PREP_ERASE
+	size_t size;
+#endif
+
+	if (!ota_prep.part) {
+		ota_prep.part = esp_ota_get_next_update_partition(NULL);
+		if (!ota_prep.part)
+			return;
+	}
+
+#ifdef OTA_PREP_BUF
+	if (!ota_prep.buf)
+		ota_prep.buf = heap_caps_malloc(OTA_BUFSIZE, OTA_MALLOC_CAPS);
+#endif
+
+#ifdef OTA_PREP_ERASE
+ #ifdef OTA_CLEAN_LOCK
+	xSemaphoreTake(ota_clean.lock, portMAX_DELAY);
+ #endif
+	// don't wipe a freshly written image, nor the sectors of an unfinished ranged upload
+	if (ota_clean.part != ota_prep.part && ota_prep.part != esp_ota_get_boot_partition()
+ #ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+	    && !ota_sess.imglen
+ #endif
+	    ) {
+		size = (ota_prep.part->size < OTA_PREP_ERASE) ? ota_prep.part->size : OTA_PREP_ERASE;
+		if (esp_partition_erase_range(ota_prep.part, 0, size) == ESP_OK) {
+			ota_clean.part = ota_prep.part;
+			ota_clean.size = size;
+		}
+		else
+			ESP_LOGW(TAG, "Failed to pre-erase %s", ota_prep.part->label);
+	}
+ #ifdef OTA_CLEAN_LOCK
+	xSemaphoreGive(ota_clean.lock);
+ #endif
+#endif
+}
+#endif /* CONFIG_SIMPLE_PUSHOTA_PREPARE */
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_BG_ERASE
+/**
+ * Background erase task.
+ * Erases the partition slice by slice, letting other tasks run in between, until it is fully erased
+ * or about to be written to (see ota_clean_take()).
+ * @param arg the partition
+ */
+static void ota_clean_task(void *arg)
+{
+	const esp_partition_t *part = arg;
+	esp_err_t ret = ESP_OK;
+	size_t n;
+
+	ESP_LOGI(TAG, "Erasing %s in the background", part->label);
 
-#include "lwip/err.h"
-#include "lwip/sockets.h"
-#include "lwip/sys.h"
-#include "lwip/netdb.h"
+	xSemaphoreTake(ota_clean.lock, portMAX_DELAY);
+	while (ota_clean.part == part && ota_clean.size < part->size) {
+		n = (part->size - ota_clean.size < OTA_BG_SLICE) ? part->size - ota_clean.size : OTA_BG_SLICE;
+		ret = esp_partition_erase_range(part, ota_clean.size, n);
+		if (ret != ESP_OK)
+			break;
+		ota_clean.size += n;
 
-#define OTA_PORT		CONFIG_SIMPLE_PUSHOTA_PORT
-#define OTA_BUFSIZE		1024
+		xSemaphoreGive(ota_clean.lock);
+		vTaskDelay(1);	// yield, even to lower priority tasks
+		xSemaphoreTake(ota_clean.lock, portMAX_DELAY);
+	}
 
-#define KEEPALIVE_IDLE		5	// delay (s) before starting sending keepalives
-#define KEEPALIVE_INTERVAL	5	// keepalive probes period (s)
-#define KEEPALIVE_COUNT		3	// max unanswered before timeout
+	if (ret != ESP_OK)
+		ESP_LOGE(TAG, "Background erase: %s", esp_err_to_name(ret));
+	else if (ota_clean.part == part) {
+		ESP_LOGI(TAG, "%s erased", part->label);
+		ota_clean_store(part);
+	}
 
-#ifdef CONFIG_SIMPLE_PUSHOTA_ENABLED
-static const char * TAG = "pushota";
+	ota_clean.task = NULL;
+	xSemaphoreGive(ota_clean.lock);
+	vTaskDelete(NULL);
+}
+#endif /* CONFIG_SIMPLE_PUSHOTA_BG_ERASE */
 
 /**
- * Perform OTA firmware update.
- * Parse basic HTTP requests containing either:
- * - POST request with:
- *  - Header "Content-Length": binary image size
- *  - Payload: raw binary image
- * - DELETE request with no content to abort the OTA process
- * - GET request (if enabled via CONFIG_SIMPLE_PUSHOTA_GETVERSION) to query the current firmware version
- * @param sock accept()'d input socket
- * @return execution status: it is safe to call esp_restart() after this returns ESP_OK
+ * Accept a connection and perform OTA update.
+ * @param lsock the listening connection
+ * @param persistent false if lsock must be closed as soon as possible
+ * @param cfg the configuration
+ * @param wait how long to wait (ms) for a connection, 0 to wait forever
+ * @return execution status, ESP_ERR_TIMEOUT if no connection was made
  */
-static int ota_receive(int sock)
+static esp_err_t ota_run(ota_listener_t lsock, bool persistent, const pushota_config_t *cfg, int wait)
 {
-	char buf[OTA_BUFSIZE];
-	const esp_partition_t *upart = esp_ota_get_next_update_partition(NULL);
-	esp_ota_handle_t ota_handle;
-	char c, *s, *binstart;
-	const char *needle, *status = "500 Internal Server Error";
-	int binlen, len, ret = ESP_FAIL;
-
-	// assume the HTTP headers fit the buffer
-	s = buf;
-	do {
-		// recv until we detect end of headers (or buffer full)
-		len = recv(sock, s, sizeof(buf)-1 - (s-buf), 0);	// last char must be '\0'
-		if (len <= 0)
-			return ESP_FAIL;
+	esp_err_t ret;
+#ifndef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+	struct ota_conn conn;
+	char *buf;
+#endif
 
-		s[len] = '\0';	// string ops need null-terminated haystack, make sure it is
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+	ret = ota_sess_init();
+	if (ret != ESP_OK)
+		return ret;
+#endif
 
-		// locate end of header
-		needle = "\r\n\r\n";	// separator between headers and content
-		binstart = strstr(s, needle);
+#ifdef CONFIG_SIMPLE_PUSHOTA_PREPARE
+	ota_prepare();
+#endif
 
-		s += len;
-	} while ((s-buf < sizeof(buf)-1) && !binstart);
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+	ret = ota_parallel(lsock, cfg, wait);
 
-	if (!binstart) {
-		status = "431 Request Header Fields Too Large";
-		goto outstatus;
-	}
+	if (!persistent)
+		ota_unlisten(lsock);
 
-	binstart += strlen(needle);	// stays within buf
+	return ret;
+#else
+	// don't run in a loop as we will only accept one stream
 
-	// leftover buffer, start of app image
-	len = s - binstart;
+	if (wait)
+		ota_listen_timeout(lsock, wait);
 
-	// move null termination to header end before further processing
-	c = *binstart;
-	*binstart = '\0';
+	ret = ota_accept(lsock, &conn);
 
-	/*
-	 parse POST header (no space around '/' in Accept), e.g.:
+	if (wait)
+		ota_listen_timeout(lsock, 0);
 
-	 POST / HTTP/1.1
-	 Host: localhost:8888
-	 Authorization: Basic dXNlcjpwYXNz
-	 User-Agent: curl/7.64.1
-	 Accept: * / *
-	 Content-Length: 182
-	 Content-Type: application/octet-stream
-	*/
+	if (!persistent)
+		ota_unlisten(lsock);	// only allow exactly one connection, others get ECONNREFUSED
 
-#ifdef CONFIG_SIMPLE_PUSHOTA_GETVERSION
-	if (!strncmp(buf, "GET ", 4)) {
-		const esp_app_desc_t *desc = esp_app_get_description();
-		len = sprintf(buf, "HTTP/1.0 200 OK\r\n\r\nVersion: %s\n", desc->version);
-		send(sock, buf, len, 0);
-		return ESP_FAIL;
-	}
-#endif
+	if (ret != ESP_OK)
+		return (ret == ESP_ERR_TIMEOUT) ? ret : ESP_FAIL;
 
-	// provide a way to abort
-	if (!strncmp(buf, "DELETE ", 7)) {
-		status = "204 No Content";
-		ESP_LOGI(TAG, "Aborting.");
-		ret = ESP_OK;
-		goto outstatus;
+	if (cfg->conn_cb) {
+		ESP_LOGD(TAG, "running conn_cb");
+		cfg->conn_cb();
 	}
 
-	if (strncmp(buf, "POST ", 5)) {
-		status = "405 Method Not Allowed";
-		goto outstatus;
-	}
+#ifdef OTA_PREP_BUF
+	buf = ota_prep.buf;
+	ota_prep.buf = NULL;
+#else
+	buf = NULL;
+#endif
 
-	if (!upart) {
-		status = "501 Not Implemented";
-		ESP_LOGE(TAG, "No OTA part available!");
-		ret = ESP_ERR_NOT_SUPPORTED;
-		goto outstatus;
-	}
+	return ota_serve(&conn, cfg, buf);
+#endif
+}
 
-	ESP_LOGI(TAG, "target OTA part %s subtype %#x addr %#" PRIx32, upart->label, upart->subtype, upart->address);
+static ota_listener_t srv_sock = OTA_NO_LISTENER;	///< persistent listener, see pushota_server_start()
 
-	needle = "Content-Length:";
-	s = strstr(buf, needle);
-	if (!s) {
-		status = "411 Length Required";
-		goto outstatus;
-	}
+/** Connection served by pushota_server_poll() */
+struct ota_pconn {
+	struct ota_conn conn;
+	struct ota_req req;		///< current request
+	pushota_config_t cfg;		///< copy of the configuration, which must last as long as the connection
+	char *buf;			///< receive buffer, OTA_BUFSIZE long
+	int64_t last;			///< time (us) data was last received
+	bool idle;			///< true while waiting for a subsequent request on a persistent connection
+};
 
-	s += strlen(needle);
-	binlen = strtol(s, NULL, 10);
-	if (!binlen) {
-		status = "411 Length Required";
-		goto outstatus;
-	}
+static struct ota_pconn *srv_conn;	///< connection in progress, see pushota_server_poll()
 
-	ESP_LOGI(TAG, "Image size: %d bytes", binlen);
+/**
+ * Close the connection served by pushota_server_poll().
+ */
+static void ota_poll_close(void)
+{
+	ota_close(&srv_conn->conn);
+	heap_caps_free(srv_conn->buf);
+	heap_caps_free(srv_conn);
+	srv_conn = NULL;
+}
 
-	// done with headers, setup OTA
-	if (esp_ota_begin(upart, binlen, &ota_handle) != ESP_OK)
-		goto failota;
+/**
+ * Accept a connection unless one is in progress, then advance its current request, receiving data at most once.
+ * Receive timeouts are measured between calls.
+ * @param lsock the persistent listening connection
+ * @param cfg the configuration, used for the whole of a new connection
+ * @return execution status of the request completed by this call, ESP_ERR_TIMEOUT if none was
+ */
+static esp_err_t ota_poll(ota_listener_t lsock, const pushota_config_t *cfg)
+{
+	struct ota_pconn *p = srv_conn;
+	struct ota_conn conn;
+	int64_t now, timeout;
+	esp_err_t ret;
 
-	// write leftover buf pertaining to app image
-	*binstart = c;
-	if (len) {
-		if (esp_ota_write(ota_handle, binstart, len) != ESP_OK)
-			goto failota;
-		binlen -= len;
-	}
+	if (!p) {
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+		// connections are served one at a time, requests share the session state nonetheless
+		ret = ota_sess_init();
+		if (ret != ESP_OK)
+			return ret;
+#endif
+#ifdef CONFIG_SIMPLE_PUSHOTA_PREPARE
+		ota_prepare();
+#endif
 
-	// loop until we receive the full image
-	while (binlen) {
-		len = recv(sock, buf, (sizeof(buf) < binlen) ? sizeof(buf) : binlen, 0);
-		if (len < 0)
-			goto failota;
-		if (!len)	// EOF
-			break;
+		ota_listen_timeout(lsock, OTA_POLL_WAIT);
+		ret = ota_accept(lsock, &conn);
+		ota_listen_timeout(lsock, 0);
+		if (ret != ESP_OK)
+			return (ret == ESP_ERR_TIMEOUT) ? ret : ESP_FAIL;
 
-		if (esp_ota_write(ota_handle, buf, len) != ESP_OK)
-			goto failota;
+		if (cfg->conn_cb) {
+			ESP_LOGD(TAG, "running conn_cb");
+			cfg->conn_cb();
+		}
 
-		binlen -= len;
-	}
+		// the buffer must outlive this call
+		p = heap_caps_malloc(sizeof(*p), OTA_MALLOC_CAPS);
+		if (p) {
+#ifdef OTA_PREP_BUF
+			p->buf = ota_prep.buf;
+			ota_prep.buf = NULL;
+#else
+			p->buf = NULL;
+#endif
+			if (!p->buf)
+				p->buf = heap_caps_malloc(OTA_BUFSIZE, OTA_MALLOC_CAPS);
+		}
+		if (!p || !p->buf) {
+			ESP_LOGE(TAG, "Out of memory");
+			heap_caps_free(p);
+			ota_close(&conn);
+			return ESP_ERR_NO_MEM;
+		}
 
-	if (binlen)	// incomplete transfer
-		goto failota;
+		p->conn = conn;
+		p->cfg = *cfg;
+		srv_conn = p;
 
-	ret = esp_ota_end(ota_handle);
-	if (ret != ESP_OK)
-		return ret;
+		ret = ota_conn_opts(&p->conn, &p->cfg);
+		if (ret != ESP_OK) {
+			ota_poll_close();
+			return ret;
+		}
+		p->conn.nonblock = true;
 
-	ESP_LOGI(TAG, "Flash complete");
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+		ota_sess.cfg = &p->cfg;
+#endif
+		ota_req_init(&p->req, p->buf, 0, &p->cfg);
+		p->last = esp_timer_get_time();
+		p->idle = false;
+	}
 
-	ret = esp_ota_set_boot_partition(upart);
-	if (ret == ESP_OK)
-		len = sprintf(buf, "HTTP/1.0 200 OK\r\n\r\nNext boot partition: %s\n", upart->label);
-	else
-		len = sprintf(buf, "HTTP/1.0 500 Internal Server Error\r\n\r\nFailed (%d).\n", ret);
+	if (ota_req_step(&p->conn, &p->req)) {
+		p->last = esp_timer_get_time();
+		p->idle = false;
+	}
+	else {
+		now = esp_timer_get_time();
+		timeout = p->idle ? HTTP_IDLE_TIMEOUT : p->cfg.rcv_timeout;
+		if (!timeout || now - p->last < timeout * 1000000)
+			return ESP_ERR_TIMEOUT;
+		if (p->idle) {
+			ota_poll_close();
+			return ESP_ERR_TIMEOUT;
+		}
+		ESP_LOGE(TAG, "Receive timeout");
+		ota_req_abort(&p->conn, &p->req);
+	}
 
-	send(sock, buf, len, 0);
+	if (p->req.state != REQ_DONE)
+		return ESP_ERR_TIMEOUT;
 
-	return ret;
+	// a connection closed without a (further) request completes none
+	ret = p->req.fill ? p->req.ret : ESP_ERR_TIMEOUT;
+	if (p->req.pending < 0)
+		ota_poll_close();
+	else {
+		// persistent connection
+		p->idle = !p->req.pending;
+		ota_req_init(&p->req, p->buf, p->req.pending, &p->cfg);
+	}
 
-failota:
-	ESP_LOGE(TAG, "ota_receive() failed");
-#ifndef CONFIG_IDF_TARGET_ESP8266
-	esp_ota_abort(ota_handle);
-#endif
-outstatus:
-	s = stpcpy(buf, "HTTP/1.0 ");
-	s = stpcpy(s, status);
-	s = stpcpy(s, "\r\n\r\n");
-	send(sock, buf, s-buf, 0);
 	return ret;
 }
 #endif /* CONFIG_SIMPLE_PUSHOTA_ENABLED */
 
 /**
- * Setup push OTA tcp socket and perform OTA update.
+ * Setup push OTA tcp socket and perform OTA update, with the default configuration.
+ * If pushota_server_start() has been called, the persistent listening socket is used instead.
  * @param conn_cb an optional callback to a function executed when a new connection is made,
  * immediately prior to reading from it. Can be used to stop tasks and reclaim memory.
  * @return execution status
@@ -227,82 +4937,310 @@ outstatus:
 esp_err_t pushota(void (*conn_cb)(void))
 {
 #ifdef CONFIG_SIMPLE_PUSHOTA_ENABLED
-	// we only care about ipv4
-	struct sockaddr_in dest_addr, source_addr;
-	socklen_t addr_len;
-	int sock, ret;
+	pushota_config_t cfg = PUSHOTA_CONFIG_DEFAULT();
 
-	dest_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	dest_addr.sin_family = AF_INET;
-	dest_addr.sin_port = htons(OTA_PORT);
+	cfg.conn_cb = conn_cb;
 
-	// don't run in a loop as we will only accept one stream
+	return pushota_ex(&cfg);
+#else	/* CONFIG_SIMPLE_PUSHOTA_ENABLED */
+	return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
 
-	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-	if (sock < 0) {
-		ESP_LOGE(TAG, "socket(): %s", strerror(errno));
+/**
+ * Setup push OTA tcp socket and perform OTA update.
+ * If pushota_server_start() has been called, the persistent listening socket is used instead,
+ * and the listening parameters of the configuration are ignored.
+ * @param cfg the configuration, see PUSHOTA_CONFIG_DEFAULT()
+ * @return execution status
+ */
+esp_err_t pushota_ex(const pushota_config_t *cfg)
+{
+#ifdef CONFIG_SIMPLE_PUSHOTA_ENABLED
+	ota_listener_t lsock;
+	bool persistent;
+
+	if (!cfg)
+		return ESP_ERR_INVALID_ARG;
+
+	persistent = (srv_sock != OTA_NO_LISTENER);
+	lsock = persistent ? srv_sock : ota_listen(cfg);
+	if (lsock == OTA_NO_LISTENER)
 		return ESP_FAIL;
-	}
 
-	ret = ESP_FAIL;
+	return ota_run(lsock, persistent, cfg, 0);
+#else	/* CONFIG_SIMPLE_PUSHOTA_ENABLED */
+	return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
 
-#ifdef CONFIG_LWIP_SO_REUSE
-	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int))) {
-		ESP_LOGE(TAG, "SO_REUSEADDR: %s", strerror(errno));
+/**
+ * Join the push OTA multicast group and perform OTA update from a multicast stream.
+ * Blocks until an image has been fully received from a sender, see README.
+ * The configuration port is used as the UDP port, and the bind address (if any) selects the interface.
+ * The connection callback is executed when the first packet of a session is received.
+ * @param cfg the configuration, NULL for the default configuration
+ * @return execution status
+ */
+esp_err_t pushota_multicast(const pushota_config_t *cfg)
+{
+#ifdef CONFIG_SIMPLE_PUSHOTA_MULTICAST
+	pushota_config_t defcfg = PUSHOTA_CONFIG_DEFAULT();
+	esp_err_t ret;
+	int sock;
+#ifdef CONFIG_SIMPLE_PUSHOTA_BUF_STACK
+	char buf[OTA_BUFSIZE];
+#else
+	char *buf;
+#endif
+
+	if (!cfg)
+		cfg = &defcfg;
+
+#ifndef CONFIG_SIMPLE_PUSHOTA_BUF_STACK
+	buf = heap_caps_malloc(OTA_BUFSIZE, OTA_MALLOC_CAPS);
+	if (!buf) {
+		ESP_LOGE(TAG, "Out of memory");
+		return ESP_ERR_NO_MEM;
+	}
+#endif
+
+	sock = ota_mcast_open(cfg);
+	if (sock < 0) {
+		ret = ESP_FAIL;
 		goto out;
 	}
+
+	ret = ota_mcast_receive(sock, buf, cfg);
+
+	close(sock);
+out:
+#ifndef CONFIG_SIMPLE_PUSHOTA_BUF_STACK
+	heap_caps_free(buf);
+#endif
+	return ret;
 #else
-	ESP_LOGW(TAG, "Warning: SO_REUSEADDR is not available!");
+	return ESP_ERR_NOT_SUPPORTED;
 #endif
+}
 
-	if (bind(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr))) {
-		ESP_LOGE(TAG, "bind(): %s", strerror(errno));
-		goto out;
+/**
+ * Push the image written by the last successful update to other devices, using the regular upload protocol.
+ * Meant to be called once pushota() (or pushota_multicast()) has returned ESP_OK, before restarting,
+ * so that a rollout can fan out from device to device. Peers are updated one after the other.
+ * @param peers the peer addresses, "host" or "host:port" (the configuration port is used by default)
+ * @param npeers the number of peers
+ * @param cfg the configuration providing the default port, the send/receive timeout (CONFIG_SIMPLE_PUSHOTA_FANOUT_TIMEOUT
+ * if 0) and the keepalive settings, NULL for the default configuration
+ * @return ESP_OK if all peers have been updated, ESP_ERR_INVALID_STATE if no update has succeeded, ESP_FAIL otherwise
+ */
+esp_err_t pushota_fanout(const char *const *peers, int npeers, const pushota_config_t *cfg)
+{
+#ifdef CONFIG_SIMPLE_PUSHOTA_FANOUT
+	pushota_config_t defcfg = PUSHOTA_CONFIG_DEFAULT();
+	char hash[sizeof("X-SHA256: \r\n") + 64] = "";
+	esp_err_t ret = ESP_OK;
+	char *buf;
+	int i;
+#ifdef CONFIG_SIMPLE_PUSHOTA_DIGEST
+	mbedtls_sha256_context ctx;
+	uint8_t sha256[32];
+#endif
+
+	if (!ota_last.part)
+		return ESP_ERR_INVALID_STATE;
+
+	if (!cfg)
+		cfg = &defcfg;
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_DIGEST
+	// let peers check the image before using it
+	mbedtls_sha256_init(&ctx);
+	mbedtls_sha256_starts(&ctx, 0);
+	ret = ota_part_sha256(&ctx, ota_last.part, ota_last.len);
+	mbedtls_sha256_finish(&ctx, sha256);
+	mbedtls_sha256_free(&ctx);
+	if (ret != ESP_OK)
+		return ret;
+	strcpy(hash, "X-SHA256: ");
+	for (i = 0; i < sizeof(sha256); i++)
+		sprintf(hash + 10 + 2 * i, "%02x", sha256[i]);
+	strcat(hash, "\r\n");
+#endif
+
+	buf = heap_caps_malloc(OTA_BUFSIZE, OTA_MALLOC_CAPS);
+	if (!buf) {
+		ESP_LOGE(TAG, "Out of memory");
+		return ESP_ERR_NO_MEM;
 	}
 
-	if (listen(sock, 1)) {
-		ESP_LOGE(TAG, "listen(): %s", strerror(errno));
-		goto out;
+	for (i = 0; i < npeers; i++) {
+		if (ota_fanout_peer(peers[i], hash, buf, cfg) != ESP_OK)
+			ret = ESP_FAIL;
 	}
 
-	ESP_LOGI(TAG, "Socket port %d", OTA_PORT);
-	addr_len = sizeof(source_addr);
+	heap_caps_free(buf);
 
-	ret = accept(sock, (struct sockaddr *)&source_addr, &addr_len);
-	if (ret < 0) {
-		ESP_LOGE(TAG, "accept(): %d", errno);
-		ret = ESP_FAIL;
+	return ret;
+#else
+	return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/**
+ * Erase the next update partition in the background, so that the next update writes at raw flash speed.
+ * The partition is erased slice by slice by a low priority task, and recorded as erased in NVS once done,
+ * so that this is not repeated after a restart. An update starting in the meantime takes over from the erase.
+ * Returns at once. NVS must have been initialized.
+ * @return execution status, ESP_ERR_INVALID_STATE if the partition holds an image to boot or an unfinished upload,
+ * or if a background erase is already running
+ */
+esp_err_t pushota_erase_start(void)
+{
+#ifdef CONFIG_SIMPLE_PUSHOTA_BG_ERASE
+	const esp_partition_t *part = esp_ota_get_next_update_partition(NULL);
+	esp_err_t ret = ESP_OK;
+
+	if (!part)
+		return ESP_ERR_NOT_FOUND;
+
+	// don't wipe a freshly written image
+	if (part == esp_ota_get_boot_partition())
+		return ESP_ERR_INVALID_STATE;
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+	ret = ota_sess_init();
+	if (ret != ESP_OK)
+		return ret;
+#else
+	if (!ota_clean.lock) {
+		ota_clean.lock = xSemaphoreCreateMutex();
+		if (!ota_clean.lock)
+			return ESP_ERR_NO_MEM;
+	}
+#endif
+
+	xSemaphoreTake(ota_clean.lock, portMAX_DELAY);
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+	// nor the sectors of an unfinished ranged upload
+	if (ota_sess.imglen) {
+		ret = ESP_ERR_INVALID_STATE;
 		goto out;
 	}
+#endif
 
-	close(sock);	// only allow exactly one connection, others get ECONNREFUSED
-	sock = ret;
+	if (ota_clean.task) {
+		ret = ESP_ERR_INVALID_STATE;
+		goto out;
+	}
 
-	if (conn_cb) {
-		ESP_LOGD(TAG, "running conn_cb");
-		conn_cb();
+	if (ota_clean.part != part) {
+		ota_clean.part = part;
+		ota_clean.size = ota_clean_load(part) ? part->size : 0;
 	}
 
-	// make sure unclean client shutdown won't DoS us
-	if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &(int){ 1 }, sizeof(int))) {
-		ESP_LOGE(TAG, "SO_KEEPALIVE: %d", errno);
-		ret = ESP_FAIL;
+	if (ota_clean.size >= part->size) {
+		ESP_LOGI(TAG, "%s already erased", part->label);
 		goto out;
 	}
-	// assume cannot fail if the above succeeds
-	setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &(int){ KEEPALIVE_IDLE }, sizeof(int));
-	setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &(int){ KEEPALIVE_INTERVAL }, sizeof(int));
-	setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &(int){ KEEPALIVE_COUNT }, sizeof(int));
-	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
 
-	ret = ota_receive(sock);
+	if (xTaskCreate(ota_clean_task, "ota_erase", OTA_BG_STACK, (void *)part, CONFIG_SIMPLE_PUSHOTA_BG_ERASE_PRIO, &ota_clean.task) != pdPASS) {
+		ESP_LOGE(TAG, "Failed to create erase task");
+		ota_clean.task = NULL;
+		ret = ESP_ERR_NO_MEM;
+	}
 
 out:
-	shutdown(sock, SHUT_RDWR);
-	close(sock);
-
+	xSemaphoreGive(ota_clean.lock);
 	return ret;
-#else	/* CONFIG_SIMPLE_PUSHOTA_ENABLED */
+#else
+	return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/**
+ * Open a persistent push OTA listening socket.
+ * Subsequent calls to pushota() will accept connections on this socket instead of
+ * setting up (and tearing down) their own, until pushota_server_stop() is called.
+ * Connections are still processed one at a time, when pushota() is running.
+ * @param cfg the configuration providing the listening parameters, NULL for the default configuration
+ * @return execution status
+ */
+esp_err_t pushota_server_start(const pushota_config_t *cfg)
+{
+#ifdef CONFIG_SIMPLE_PUSHOTA_ENABLED
+	pushota_config_t defcfg = PUSHOTA_CONFIG_DEFAULT();
+
+	if (srv_sock != OTA_NO_LISTENER)
+		return ESP_ERR_INVALID_STATE;
+
+	srv_sock = ota_listen(cfg ? cfg : &defcfg);
+
+	return (srv_sock == OTA_NO_LISTENER) ? ESP_FAIL : ESP_OK;
+#else
+	return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/**
+ * Get the socket pushota_server_poll() is waiting on, e.g. to wait for it in an existing select() loop
+ * instead of dedicating a task to pushota(). Once it is readable, call pushota_server_poll().
+ * This is the persistent listening socket, or the connection in progress if any: it may change after each call.
+ * @return the socket descriptor, -1 if pushota_server_start() has not been called or with the netconn API
+ */
+int pushota_server_fd(void)
+{
+#if defined(CONFIG_SIMPLE_PUSHOTA_ENABLED) && !defined(CONFIG_SIMPLE_PUSHOTA_NET_NETCONN)
+	return srv_conn ? srv_conn->conn.sock : srv_sock;
+#else
+	return -1;
+#endif
+}
+
+/**
+ * Serve the persistent push OTA listening socket one step at a time.
+ * Accepts a pending connection unless one is in progress, then receives data from it at most once,
+ * without waiting: this can be called whenever pushota_server_fd() is readable, or periodically
+ * (e.g. from an esp_event handler or a timer task). Connections are served one at a time, as by pushota_ex().
+ * Responses, flash erase and writes, and image verification still block the caller while they run.
+ * @param cfg the configuration, NULL for the default configuration: only used when a connection is accepted
+ * @return execution status of the request completed by this call, which is an update if ESP_OK,
+ * ESP_ERR_TIMEOUT if none was, ESP_ERR_INVALID_STATE if pushota_server_start() has not been called
+ */
+esp_err_t pushota_server_poll(const pushota_config_t *cfg)
+{
+#ifdef CONFIG_SIMPLE_PUSHOTA_ENABLED
+	pushota_config_t defcfg = PUSHOTA_CONFIG_DEFAULT();
+
+	if (srv_sock == OTA_NO_LISTENER)
+		return ESP_ERR_INVALID_STATE;
+
+	return ota_poll(srv_sock, cfg ? cfg : &defcfg);
+#else
 	return ESP_ERR_NOT_SUPPORTED;
 #endif
 }
+
+/**
+ * Close the persistent push OTA listening socket.
+ * A pending pushota() call waiting for a connection will return ESP_FAIL.
+ * A connection in progress with pushota_server_poll() is closed, failing any update it carries.
+ */
+void pushota_server_stop(void)
+{
+#ifdef CONFIG_SIMPLE_PUSHOTA_ENABLED
+	ota_listener_t lsock = srv_sock;
+
+	if (lsock == OTA_NO_LISTENER)
+		return;
+
+	if (srv_conn) {
+		ota_req_abort(&srv_conn->conn, &srv_conn->req);
+		ota_poll_close();
+	}
+
+	srv_sock = OTA_NO_LISTENER;
+	ota_unlisten(lsock);
+#endif
+}
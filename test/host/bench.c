@@ -0,0 +1,715 @@
+//
+//  bench.c
+//
+//  Host build: push OTA benchmark driver.
+//  Pushes images to the component over loopback, with the receive sizes and flash latencies set on the command
+//  line, and reports the throughput and the time spent in each phase of the update, see README.
+//
+//  (C) 2022 Thibaut VARENE
+//  License: GPLv2 - http://www.gnu.org/licenses/gpl-2.0.html
+//
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "simple_pushota.h"
+#include "host.h"
+
+#ifndef CONFIG_SIMPLE_PUSHOTA_STATS
+ #error "the benchmark requires CONFIG_SIMPLE_PUSHOTA_STATS"
+#endif
+
+#define IMAGE_MAGIC	0xE9
+#define SEND_SIZE	16384	///< client write size
+#define MAX_CONNS	8	///< maximum number of parallel ranged uploads
+#define PAD_LINE	200	///< padding header line length, see send_pad()
+#define PAD_MIN		32	///< minimum padding header line length
+
+#define DELTA_MAGIC	"ENDSLEY/BSDIFF43"
+#define DELTA_DIFF	3840	///< diff bytes per patch control block
+#define DELTA_EXTRA	256	///< extra bytes per patch control block, replacing as many old bytes
+
+static const char *TAG = "bench";
+
+/** Benchmark settings */
+static struct {
+	size_t size;		///< image size
+	const char *chunks;	///< receive size list, see host_set_chunks()
+	int rounds;
+	size_t http_chunk;	///< HTTP chunk size, 0 to send a Content-Length
+	int port;
+	bool poll;		///< serve with pushota_server_poll() instead of pushota_ex()
+	unsigned seed;
+	uint64_t min_rate;	///< minimum average rate (bytes/s), 0 for none
+	uint64_t max_rate;	///< maximum average rate (bytes/s), 0 for none
+	int every;		///< if set, only change one sector in every this many between rounds
+	bool delta;		///< send patches against the running image
+	int conns;		///< number of ranged uploads sent in parallel, 0 for one regular upload
+	size_t pad;		///< amount of extra request header lines, 0 for none
+} opts = {
+	.size = 1 << 20,
+	.chunks = "1460",
+	.rounds = 3,
+	.port = CONFIG_SIMPLE_PUSHOTA_PORT,
+	.seed = 1,
+};
+
+/** Client request */
+struct client {
+	const uint8_t *body;
+	size_t len;		///< body length
+	size_t first, total;	///< range, if total is set
+	int status;		///< HTTP response status, -1 on error
+	pthread_t thread;
+};
+
+/** Phases of pushota_stats_t, in request order */
+static const struct {
+	const char *name;
+	size_t off;
+} phases[] = {
+	{ "header", offsetof(pushota_stats_t, header_us) },
+	{ "begin", offsetof(pushota_stats_t, begin_us) },
+	{ "recv", offsetof(pushota_stats_t, recv_us) },
+	{ "write", offsetof(pushota_stats_t, write_us) },
+	{ "end", offsetof(pushota_stats_t, end_us) },
+	{ "boot", offsetof(pushota_stats_t, boot_us) },
+};
+
+#define NPHASES		(sizeof(phases) / sizeof(phases[0]))
+#define PHASE(st, i)	(*(const int64_t *)((const char *)(st) + phases[i].off))
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -s SIZE   image size, with an optional k or M suffix (default 1M)\n"
+		"  -d LIST   receive sizes: comma separated N, MIN-MAX or either followed by xCOUNT,\n"
+		"            or @FILE to read them from a file; replayed in a loop (default 1460)\n"
+		"  -n N      number of rounds (default 3)\n"
+		"  -e US     flash erase time per 4k sector (default 16000)\n"
+		"  -w US     flash write setup time per call (default 10)\n"
+		"  -b NS     flash write time per byte (default 2500)\n"
+		"  -r NS     flash read time per byte, for image verification (default 80)\n"
+		"  -u N      only change one sector in every N from one round to the next\n"
+		"  -D        send patches against the running image to /delta, changing one sector in 16 unless -u\n"
+		"  -j N      send the image as N parallel ranged uploads (PUT)\n"
+		"  -c SIZE   send the image with Transfer-Encoding: chunked, in SIZE chunks\n"
+		"  -H SIZE   add about SIZE bytes of header lines to each request\n"
+		"  -p PORT   listen port (default %d)\n"
+		"  -P        serve with pushota_server_poll() instead of pushota_ex()\n"
+		"  -S SEED   seed for the image contents and the MIN-MAX receive sizes (default 1)\n"
+		"  -m RATE   fail if the average rate (bytes/s, optional k or M suffix) is lower\n"
+		"  -M RATE   fail if the average rate is higher\n"
+		"  -v        increase verbosity\n", name, CONFIG_SIMPLE_PUSHOTA_PORT);
+	exit(2);
+}
+
+/**
+ * Parse a size.
+ * @param s the size, with an optional k or M suffix
+ * @param out the parsed size
+ * @return 0 on success, -1 on error
+ */
+static int parse_size(const char *s, uint64_t *out)
+{
+	char *end;
+	uint64_t n;
+
+	errno = 0;
+	n = strtoull(s, &end, 10);
+	if (errno || end == s)
+		return -1;
+
+	switch (*end) {
+	case 'k':
+	case 'K':
+		n <<= 10;
+		end++;
+		break;
+	case 'M':
+		n <<= 20;
+		end++;
+		break;
+	}
+
+	if (*end)
+		return -1;
+
+	*out = n;
+	return 0;
+}
+
+/**
+ * Fill an image with pseudo-random data.
+ * @param image the image, opts.size long
+ * @param seed the contents seed
+ */
+static void image_fill(uint8_t *image, unsigned seed)
+{
+	size_t i;
+
+	image[0] = IMAGE_MAGIC;
+	for (i = 1; i < opts.size; i++)
+		image[i] = rand_r(&seed);
+}
+
+/**
+ * Compute the image of a round.
+ * @param image the image, opts.size long
+ * @param round the round number
+ */
+static void image_round(uint8_t *image, int round)
+{
+	size_t off;
+
+	if (!opts.every) {
+		image_fill(image, opts.seed + round);
+		return;
+	}
+
+	// same base image, with one sector in every opts.every changed
+	image_fill(image, opts.seed);
+	for (off = 1; off < opts.size; off += (size_t)opts.every * SPI_FLASH_SEC_SIZE)
+		image[off] ^= round + 1;
+}
+
+static void offtout(int64_t x, uint8_t *buf)
+{
+	uint64_t y = (x < 0) ? -x : x;
+	int i;
+
+	for (i = 0; i < 8; i++, y >>= 8)
+		buf[i] = y & 0xff;
+	if (x < 0)
+		buf[7] |= 0x80;
+}
+
+/**
+ * Build a patch, in the uncompressed bsdiff 4.3 layout (see README).
+ * Each control block covers DELTA_DIFF bytes patched from the old image and DELTA_EXTRA new bytes.
+ * @param old the old image, opts.size long
+ * @param image the new image, opts.size long
+ * @param len will be set to the patch length
+ * @return the patch, NULL if out of memory
+ */
+static uint8_t *delta_build(const uint8_t *old, const uint8_t *image, size_t *len)
+{
+	size_t blocks = (opts.size + DELTA_DIFF + DELTA_EXTRA - 1) / (DELTA_DIFF + DELTA_EXTRA);
+	size_t off, i, diff, extra;
+	uint8_t *patch, *p;
+
+	patch = malloc(24 + blocks * 24 + opts.size);
+	if (!patch)
+		return NULL;
+
+	memcpy(patch, DELTA_MAGIC, 16);
+	offtout(opts.size, patch + 16);
+	p = patch + 24;
+
+	for (off = 0; off < opts.size; off += diff + extra) {
+		diff = opts.size - off;
+		if (diff > DELTA_DIFF)
+			diff = DELTA_DIFF;
+		extra = opts.size - off - diff;
+		if (extra > DELTA_EXTRA)
+			extra = DELTA_EXTRA;
+
+		offtout(diff, p);
+		offtout(extra, p + 8);
+		offtout(extra, p + 16);		// skip the old bytes replaced by the extra bytes
+		p += 24;
+		for (i = 0; i < diff; i++)
+			*p++ = image[off + i] - old[off + i];
+		memcpy(p, image + off + diff, extra);
+		p += extra;
+	}
+
+	*len = p - patch;
+	return patch;
+}
+
+/**
+ * Install the running image, the source of the patches.
+ * @param old the image, opts.size long
+ * @return 0 on success, -1 on error
+ */
+static int delta_setup(const uint8_t *old)
+{
+	const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+	size_t len = (opts.size + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+
+	if (!part || esp_partition_erase_range(part, 0, len) != ESP_OK || esp_partition_write(part, 0, old, opts.size) != ESP_OK)
+		return -1;
+
+	return 0;
+}
+
+static int send_all(int sock, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t n;
+
+	while (len) {
+		n = send(sock, p, len, MSG_NOSIGNAL);
+		if (n < 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * Send about opts.pad bytes of extra header lines, if any.
+ * @param sock the connection
+ * @return 0 on success, -1 on error
+ */
+static int send_pad(int sock)
+{
+	char line[PAD_LINE];
+	size_t left, n, hdr;
+	int i;
+
+	// "X-Padding-N: xxx...\r\n", the last line picks up what is left unless too short for a header line
+	for (i = 0, left = opts.pad; left >= PAD_MIN; i++, left -= n) {
+		n = (left < PAD_LINE) ? left : PAD_LINE;
+		hdr = snprintf(line, sizeof(line), "X-Padding-%d: ", i);
+		memset(line + hdr, 'x', n - hdr - 2);
+		memcpy(line + n - 2, "\r\n", 2);
+		if (send_all(sock, line, n))
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Send the body of a request, as is or HTTP chunked.
+ * @param sock the connection
+ * @param c the request
+ * @return 0 on success, -1 on error
+ */
+static int send_body(int sock, const struct client *c)
+{
+	size_t off, n, max;
+	char hdr[32];
+
+	max = opts.http_chunk ? opts.http_chunk : SEND_SIZE;
+
+	for (off = 0; off < c->len; off += n) {
+		n = c->len - off;
+		if (n > max)
+			n = max;
+		if (opts.http_chunk) {
+			snprintf(hdr, sizeof(hdr), "%zx\r\n", n);
+			if (send_all(sock, hdr, strlen(hdr)))
+				return -1;
+		}
+		if (send_all(sock, c->body + off, n))
+			return -1;
+		if (opts.http_chunk && send_all(sock, "\r\n", 2))
+			return -1;
+	}
+
+	if (opts.http_chunk && send_all(sock, "0\r\n\r\n", 5))
+		return -1;
+
+	return 0;
+}
+
+static void *client_main(void *arg)
+{
+	struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(opts.port) };
+	struct client *c = arg;
+	char buf[512];
+	size_t len = 0;
+	ssize_t n;
+	int sock;
+
+	c->status = -1;
+	inet_aton(CONFIG_SIMPLE_PUSHOTA_BIND_ADDR, &sa.sin_addr);
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0 || connect(sock, (struct sockaddr *)&sa, sizeof(sa))) {
+		ESP_LOGE(TAG, "connect(): %s", strerror(errno));
+		goto out;
+	}
+
+	if (c->total)
+		len = snprintf(buf, sizeof(buf), "PUT / HTTP/1.1\r\nHost: bench\r\nContent-Length: %zu\r\n"
+			       "Content-Range: bytes %zu-%zu/%zu\r\n", c->len, c->first, c->first + c->len - 1, c->total);
+	else if (opts.http_chunk)
+		len = snprintf(buf, sizeof(buf), "POST /%s HTTP/1.1\r\nHost: bench\r\nTransfer-Encoding: chunked\r\n",
+			       opts.delta ? "delta" : "");
+	else
+		len = snprintf(buf, sizeof(buf), "POST /%s HTTP/1.1\r\nHost: bench\r\nContent-Length: %zu\r\n",
+			       opts.delta ? "delta" : "", c->len);
+	len += snprintf(buf + len, sizeof(buf) - len, "Connection: close\r\n");
+
+	// the server may fail the request early, the response is read regardless
+	if (send_all(sock, buf, len) || send_pad(sock) || send_all(sock, "\r\n", 2) || send_body(sock, c))
+		ESP_LOGW(TAG, "send(): %s", strerror(errno));
+
+	len = 0;
+	while (len < sizeof(buf) - 1 && (n = recv(sock, buf + len, sizeof(buf) - 1 - len, 0)) > 0)
+		len += n;
+	buf[len] = '\0';
+
+	if (sscanf(buf, "HTTP/1.%*d %d", &c->status) != 1) {
+		ESP_LOGE(TAG, "invalid response: \"%s\"", buf);
+		c->status = -1;
+	}
+
+out:
+	if (sock >= 0)
+		close(sock);
+	return NULL;
+}
+
+/**
+ * Serve one update request with pushota_server_poll(), as an application select() loop would.
+ * @param cfg the configuration
+ * @return the outcome of the request
+ */
+static esp_err_t serve_poll(const pushota_config_t *cfg)
+{
+	struct timeval tv;
+	fd_set rfds;
+	esp_err_t ret;
+	int fd;
+
+	do {
+		fd = pushota_server_fd();
+		if (fd >= 0) {
+			tv.tv_sec = 0;
+			tv.tv_usec = 100000;
+			FD_ZERO(&rfds);
+			FD_SET(fd, &rfds);
+			select(fd + 1, &rfds, NULL, NULL, &tv);
+		}
+		else
+			sched_yield();	// netconn: no descriptor to wait on
+		ret = pushota_server_poll(cfg);
+	} while (ret == ESP_ERR_TIMEOUT);
+
+	return ret;
+}
+
+/**
+ * Run a round: push an image and check it ended up in the update partition.
+ * @param round the round number
+ * @param old the running image, for patches
+ * @param st the request statistics
+ * @return 0 on success, -1 on failure
+ */
+static int run_round(int round, const uint8_t *old, pushota_stats_t *st)
+{
+	pushota_config_t cfg = PUSHOTA_CONFIG_DEFAULT();
+	struct client c[MAX_CONNS];
+	uint8_t *image, *patch = NULL;
+	size_t len, range;
+	int i, n, fail = -1;
+	int64_t start;
+	esp_err_t ret;
+
+	memset(c, 0, sizeof(c));
+
+	image = malloc(opts.size);
+	if (!image) {
+		ESP_LOGE(TAG, "Out of memory");
+		return -1;
+	}
+	image_round(image, round);
+
+	if (opts.delta) {
+		patch = delta_build(old, image, &len);
+		if (!patch) {
+			ESP_LOGE(TAG, "Out of memory");
+			goto out;
+		}
+		c[0].body = patch;
+		c[0].len = len;
+		n = 1;
+	}
+	else if (opts.conns) {
+		// sector aligned ranges
+		range = (opts.size / opts.conns + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+		for (n = 0; n < opts.conns && n * range < opts.size; n++) {
+			c[n].first = n * range;
+			c[n].body = image + c[n].first;
+			c[n].len = (opts.size - c[n].first < range) ? opts.size - c[n].first : range;
+			c[n].total = opts.size;
+		}
+	}
+	else {
+		c[0].body = image;
+		c[0].len = opts.size;
+		n = 1;
+	}
+
+	memset(st, 0, sizeof(*st));
+	cfg.port = opts.port;
+	cfg.stats = st;
+
+	host_reset_chunks(opts.seed + round);
+	host_flash.erases = host_flash.writes = host_flash.errors = 0;
+	host_flash.busy_us = 0;
+
+	start = esp_timer_get_time();
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&c[i].thread, NULL, client_main, &c[i])) {
+			ESP_LOGE(TAG, "pthread_create() failed");
+			n = i;
+			break;
+		}
+	}
+
+	ret = opts.poll ? serve_poll(&cfg) : pushota_ex(&cfg);
+	for (i = 0; i < n; i++)
+		pthread_join(c[i].thread, NULL);
+
+	// ranges are served concurrently and have no statistics: only time the whole update
+	if (opts.conns) {
+		st->total_us = esp_timer_get_time() - start;
+		st->received = st->written = opts.size;
+		st->rate = st->total_us ? opts.size * 1000000ULL / st->total_us : 0;
+	}
+
+	for (i = 0; i < n && c[i].status == 200; i++)
+		;
+
+	if (ret != ESP_OK)
+		ESP_LOGE(TAG, "round %d: update failed: %s", round, esp_err_to_name(ret));
+	else if (i < n)
+		ESP_LOGE(TAG, "round %d: response status %d", round, c[i].status);
+	else if (st->written != opts.size)
+		ESP_LOGE(TAG, "round %d: %zu bytes written, expected %zu", round, st->written, opts.size);
+	else if (memcmp(host_flash_data(host_update_partition()), image, opts.size))
+		ESP_LOGE(TAG, "round %d: flash contents differ from the image", round);
+	else if (host_flash.errors)
+		ESP_LOGE(TAG, "round %d: %u writes to non-erased flash", round, host_flash.errors);
+	else
+		fail = 0;
+
+out:
+	free(patch);
+	free(image);
+	return fail;
+}
+
+static void print_stats(const char *name, const pushota_stats_t *st, unsigned erases, unsigned writes, int64_t busy_us)
+{
+	int64_t other = st->total_us;
+	size_t i;
+
+	printf("%-8s %9.1f %9.1f", name, st->total_us / 1000.0, st->rate / 1024.0);
+	for (i = 0; i < NPHASES; i++) {
+		printf(" %8.1f", PHASE(st, i) / 1000.0);
+		other -= PHASE(st, i);
+	}
+	printf(" %8.1f %7d %7d %6u %6u %8.1f\n", other / 1000.0, st->min_chunk, st->max_chunk, erases, writes,
+	       busy_us / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+	pushota_config_t cfg = PUSHOTA_CONFIG_DEFAULT();
+	pushota_stats_t st, avg = { 0 };
+	uint64_t erases = 0, writes = 0, v;
+	uint8_t *old = NULL;
+	int64_t busy = 0, other;
+	int opt, round, fail = 0;
+	size_t i;
+
+	host_flash.erase_us = 16000;
+	host_flash.write_us = 10;
+	host_flash.write_ns = 2500;
+	host_flash.read_ns = 80;
+	avg.min_chunk = INT32_MAX;
+
+	while ((opt = getopt(argc, argv, "s:d:n:e:w:b:r:u:Dj:c:H:p:PS:m:M:vh")) != -1) {
+		switch (opt) {
+		case 's':
+			if (parse_size(optarg, &v) || v < 1 || v > host_update_partition()->size)
+				usage(argv[0]);
+			opts.size = v;
+			break;
+		case 'd':
+			opts.chunks = optarg;
+			break;
+		case 'n':
+			opts.rounds = atoi(optarg);
+			if (opts.rounds < 1)
+				usage(argv[0]);
+			break;
+		case 'e':
+			host_flash.erase_us = atoll(optarg);
+			break;
+		case 'w':
+			host_flash.write_us = atoll(optarg);
+			break;
+		case 'b':
+			host_flash.write_ns = atoll(optarg);
+			break;
+		case 'r':
+			host_flash.read_ns = atoll(optarg);
+			break;
+		case 'u':
+			opts.every = atoi(optarg);
+			if (opts.every < 1)
+				usage(argv[0]);
+			break;
+		case 'D':
+			opts.delta = true;
+			break;
+		case 'j':
+			opts.conns = atoi(optarg);
+			if (opts.conns < 1 || opts.conns > MAX_CONNS)
+				usage(argv[0]);
+			break;
+		case 'c':
+			if (parse_size(optarg, &v) || !v)
+				usage(argv[0]);
+			opts.http_chunk = v;
+			break;
+		case 'H':
+			if (parse_size(optarg, &v))
+				usage(argv[0]);
+			opts.pad = v;
+			break;
+		case 'p':
+			opts.port = atoi(optarg);
+			break;
+		case 'P':
+			opts.poll = true;
+			break;
+		case 'S':
+			opts.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			if (parse_size(optarg, &opts.min_rate))
+				usage(argv[0]);
+			break;
+		case 'M':
+			if (parse_size(optarg, &opts.max_rate))
+				usage(argv[0]);
+			break;
+		case 'v':
+			host_log_level++;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	// ranged uploads are raw, and served by one pushota_ex() call
+	if (optind != argc || (opts.conns && (opts.delta || opts.http_chunk || opts.poll)))
+		usage(argv[0]);
+
+	if (host_set_chunks(opts.chunks)) {
+		fprintf(stderr, "Invalid receive sizes: %s\n", opts.chunks);
+		return 2;
+	}
+
+	if (opts.delta) {
+		if (!opts.every)
+			opts.every = 16;
+		old = malloc(opts.size);
+		if (!old)
+			return 1;
+		image_fill(old, opts.seed);
+		if (delta_setup(old)) {
+			fprintf(stderr, "Cannot install the running image\n");
+			return 1;
+		}
+	}
+
+	cfg.port = opts.port;
+	if (pushota_server_start(&cfg) != ESP_OK) {
+		fprintf(stderr, "Cannot listen on port %d\n", opts.port);
+		return 1;
+	}
+
+	printf("image %zu bytes, receive sizes %s, flash erase %" PRId64 "us/sector, write %" PRId64 "us + %" PRId64
+	       "ns/byte, read %" PRId64 "ns/byte, %s%s%s\n", opts.size, opts.chunks, host_flash.erase_us, host_flash.write_us,
+	       host_flash.write_ns, host_flash.read_ns, opts.delta ? "delta, " : opts.conns ? "ranges, " : "",
+	       opts.http_chunk ? "chunked, " : "", opts.poll ? "poll" : "blocking");
+	printf("%-8s %9s %9s", "round", "total ms", "KiB/s");
+	for (i = 0; i < NPHASES; i++)
+		printf(" %8s", phases[i].name);
+	printf(" %8s %7s %7s %6s %6s %8s\n", "other", "minrecv", "maxrecv", "erases", "writes", "flash ms");
+
+	for (round = 0; round < opts.rounds; round++) {
+		char name[16];
+
+		if (run_round(round, old, &st)) {
+			fail = 1;
+			break;
+		}
+
+		snprintf(name, sizeof(name), "%d", round);
+		print_stats(name, &st, host_flash.erases, host_flash.writes, host_flash.busy_us);
+
+		for (i = 0; i < NPHASES; i++)
+			*(int64_t *)((char *)&avg + phases[i].off) += PHASE(&st, i);
+		avg.total_us += st.total_us;
+		avg.rate += st.rate;
+		if (st.min_chunk < avg.min_chunk)
+			avg.min_chunk = st.min_chunk;
+		if (st.max_chunk > avg.max_chunk)
+			avg.max_chunk = st.max_chunk;
+		erases += host_flash.erases;
+		writes += host_flash.writes;
+		busy += host_flash.busy_us;
+	}
+
+	pushota_server_stop();
+	free(old);
+
+	if (fail)
+		return 1;
+
+	for (i = 0; i < NPHASES; i++)
+		*(int64_t *)((char *)&avg + phases[i].off) /= opts.rounds;
+	avg.total_us /= opts.rounds;
+	avg.rate /= opts.rounds;
+	print_stats("average", &avg, erases / opts.rounds, writes / opts.rounds, busy / opts.rounds);
+
+	// share of each phase in the average
+	other = avg.total_us;
+	printf("%-8s %9s %9s", "%", "", "");
+	for (i = 0; i < NPHASES; i++) {
+		printf(" %8.1f", avg.total_us ? 100.0 * PHASE(&avg, i) / avg.total_us : 0);
+		other -= PHASE(&avg, i);
+	}
+	printf(" %8.1f\n", avg.total_us ? 100.0 * other / avg.total_us : 0);
+
+	if (avg.rate < opts.min_rate) {
+		fprintf(stderr, "Average rate %" PRIu32 " bytes/s is below %" PRIu64 "\n", avg.rate, opts.min_rate);
+		return 1;
+	}
+	if (opts.max_rate && avg.rate > opts.max_rate) {
+		fprintf(stderr, "Average rate %" PRIu32 " bytes/s is above %" PRIu64 "\n", avg.rate, opts.max_rate);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,329 @@
+//
+//  esp.c
+//
+//  Host build: ESP-IDF system, flash and OTA stubs.
+//  Flash is emulated in memory, with erase and write latencies modelled by sleeping, see struct host_flash.
+//
+//  (C) 2022 Thibaut VARENE
+//  License: GPLv2 - http://www.gnu.org/licenses/gpl-2.0.html
+//
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_timer.h"
+#include "host.h"
+
+#define FLASH_SIZE	(4 << 20)
+#define IMAGE_MAGIC	0xE9	// first byte of an app image
+
+int host_log_level;
+struct host_flash host_flash;
+
+static uint8_t flash[FLASH_SIZE];
+
+static const esp_partition_t parts[] = {
+	{ .type = ESP_PARTITION_TYPE_DATA, .subtype = ESP_PARTITION_SUBTYPE_DATA_NVS, .address = 0x9000, .size = 0x6000, .erase_size = SPI_FLASH_SEC_SIZE, .label = "nvs" },
+	{ .type = ESP_PARTITION_TYPE_APP, .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_0, .address = 0x10000, .size = 0x180000, .erase_size = SPI_FLASH_SEC_SIZE, .label = "ota_0" },
+	{ .type = ESP_PARTITION_TYPE_APP, .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_1, .address = 0x190000, .size = 0x180000, .erase_size = SPI_FLASH_SEC_SIZE, .label = "ota_1" },
+};
+
+#define NPARTS		(sizeof(parts) / sizeof(parts[0]))
+#define PART_RUNNING	(&parts[1])
+#define PART_UPDATE	(&parts[2])
+
+static size_t part_len[NPARTS];	///< end of the data written since each partition was last erased
+
+/** OTA update in progress, the stubs only support one at a time */
+static struct {
+	const esp_partition_t *part;
+	size_t written;		///< amount of image data written
+	size_t erased;		///< amount of the partition erased
+	bool sequential;	///< erase as we go
+	bool active;
+} ota;
+
+static const esp_partition_t *boot_part = PART_RUNNING;
+
+void host_log(int level, const char *tag, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (level > host_log_level)
+		return;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "[%s] ", tag);
+	vfprintf(stderr, fmt, ap);
+	fputc('\n', stderr);
+	va_end(ap);
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+	static __thread char name[16];
+
+	snprintf(name, sizeof(name), "%#x", code);
+	return name;
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+	return malloc(size);
+}
+
+void heap_caps_free(void *ptr)
+{
+	free(ptr);
+}
+
+int64_t esp_timer_get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Spend modelled flash time.
+ * @param us the time (us)
+ */
+static void flash_busy(int64_t us)
+{
+	struct timespec ts = { .tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000 };
+
+	if (us <= 0)
+		return;
+
+	host_flash.busy_us += us;
+	while (nanosleep(&ts, &ts))
+		;
+}
+
+static bool part_range(const esp_partition_t *part, size_t offset, size_t size)
+{
+	return offset <= part->size && size <= part->size - offset;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t offset, void *dst, size_t size)
+{
+	if (!part_range(part, offset, size))
+		return ESP_ERR_INVALID_SIZE;
+
+	flash_busy(size * host_flash.read_ns / 1000);
+	memcpy(dst, flash + part->address + offset, size);
+
+	return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *part, size_t offset, const void *src, size_t size)
+{
+	const uint8_t *s = src;
+	uint8_t *d = flash + part->address + offset;
+	size_t i;
+
+	if (!part_range(part, offset, size))
+		return ESP_ERR_INVALID_SIZE;
+
+	host_flash.writes++;
+	flash_busy(host_flash.write_us + size * host_flash.write_ns / 1000);
+
+	// NOR flash can only clear bits
+	for (i = 0; i < size; i++) {
+		if ((d[i] & s[i]) != s[i] && !host_flash.errors++)
+			ESP_LOGE("flash", "%s: write to non-erased offset %#zx", part->label, offset + i);
+		d[i] &= s[i];
+	}
+
+	if (offset + size > part_len[part - parts])
+		part_len[part - parts] = offset + size;
+
+	return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *part, size_t offset, size_t size)
+{
+	if ((offset | size) % SPI_FLASH_SEC_SIZE)
+		return ESP_ERR_INVALID_ARG;
+	if (!part_range(part, offset, size))
+		return ESP_ERR_INVALID_SIZE;
+
+	if (!offset && size >= part_len[part - parts])
+		part_len[part - parts] = 0;
+
+	host_flash.erases += size / SPI_FLASH_SEC_SIZE;
+	flash_busy(host_flash.erase_us * (size / SPI_FLASH_SEC_SIZE));
+	memset(flash + part->address + offset, 0xff, size);
+
+	return ESP_OK;
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t *part, size_t offset, size_t size,
+			     esp_partition_mmap_memory_t memory, const void **out_ptr, esp_partition_mmap_handle_t *out_handle)
+{
+	if (!part_range(part, offset, size))
+		return ESP_ERR_INVALID_SIZE;
+
+	*out_ptr = flash + part->address + offset;
+	*out_handle = 1;
+
+	return ESP_OK;
+}
+
+void esp_partition_munmap(esp_partition_mmap_handle_t handle)
+{
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+	size_t i;
+
+	for (i = 0; i < NPARTS; i++) {
+		if (type != ESP_PARTITION_TYPE_ANY && parts[i].type != type)
+			continue;
+		if (subtype != ESP_PARTITION_SUBTYPE_ANY && parts[i].subtype != subtype)
+			continue;
+		if (label && strcmp(label, parts[i].label))
+			continue;
+		return &parts[i];
+	}
+
+	return NULL;
+}
+
+const esp_partition_t *host_update_partition(void)
+{
+	return PART_UPDATE;
+}
+
+const uint8_t *host_flash_data(const esp_partition_t *part)
+{
+	return flash + part->address;
+}
+
+/**
+ * Verify an image, as the bootloader code used by esp_ota_end() and esp_ota_set_boot_partition() does:
+ * only the magic is checked, but reading the whole image back is accounted for.
+ * @param part the partition
+ * @return ESP_OK if the image is valid
+ */
+static esp_err_t image_verify(const esp_partition_t *part)
+{
+	size_t len = part_len[part - parts];
+
+	flash_busy(len * host_flash.read_ns / 1000);
+
+	return (len && flash[part->address] == IMAGE_MAGIC) ? ESP_OK : ESP_ERR_OTA_VALIDATE_FAILED;
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size, esp_ota_handle_t *out_handle)
+{
+	esp_err_t ret;
+
+	if (ota.active || partition == PART_RUNNING)
+		return ESP_ERR_INVALID_STATE;
+
+	ota.part = partition;
+	ota.written = 0;
+	ota.erased = 0;
+	ota.sequential = (image_size == OTA_WITH_SEQUENTIAL_WRITES);
+
+	if (!ota.sequential) {
+		if (image_size == OTA_SIZE_UNKNOWN)
+			image_size = partition->size;
+		image_size = (image_size + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+		if (image_size > partition->size)
+			return ESP_ERR_INVALID_SIZE;
+		ret = esp_partition_erase_range(partition, 0, image_size);
+		if (ret != ESP_OK)
+			return ret;
+		ota.erased = image_size;
+	}
+
+	ota.active = true;
+	*out_handle = 1;
+
+	return ESP_OK;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size)
+{
+	esp_err_t ret;
+
+	if (!ota.active)
+		return ESP_ERR_INVALID_ARG;
+
+	if (!ota.written && size && *(const uint8_t *)data != IMAGE_MAGIC) {
+		ESP_LOGE("ota", "OTA image has invalid magic byte");
+		return ESP_ERR_OTA_VALIDATE_FAILED;
+	}
+
+	while (ota.written + size > ota.erased) {
+		if (!ota.sequential)
+			return ESP_ERR_INVALID_SIZE;
+		ret = esp_partition_erase_range(ota.part, ota.erased, SPI_FLASH_SEC_SIZE);
+		if (ret != ESP_OK)
+			return ret;
+		ota.erased += SPI_FLASH_SEC_SIZE;
+	}
+
+	ret = esp_partition_write(ota.part, ota.written, data, size);
+	if (ret == ESP_OK)
+		ota.written += size;
+
+	return ret;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle)
+{
+	if (!ota.active)
+		return ESP_ERR_INVALID_ARG;
+
+	ota.active = false;
+
+	return image_verify(ota.part);
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle)
+{
+	ota.active = false;
+
+	return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+	esp_err_t ret;
+
+	ret = image_verify(partition);
+	if (ret != ESP_OK)
+		return ret;
+
+	boot_part = partition;
+
+	return ESP_OK;
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from)
+{
+	return PART_UPDATE;
+}
+
+const esp_partition_t *esp_ota_get_running_partition(void)
+{
+	return PART_RUNNING;
+}
+
+const esp_partition_t *esp_ota_get_boot_partition(void)
+{
+	return boot_part;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <inttypes.h>
+
+/** Log verbosity, see host_log(): 0 for errors only, 1 to add warnings, 2 to add info, 3 for everything */
+extern int host_log_level;
+
+void host_log(int level, const char *tag, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+#define ESP_LOGE(tag, fmt, ...)	host_log(0, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...)	host_log(1, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...)	host_log(2, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...)	host_log(3, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...)	host_log(3, tag, fmt, ##__VA_ARGS__)
@@ -0,0 +1,362 @@
+//
+//  freertos.c
+//
+//  Host build: FreeRTOS task, queue and semaphore stubs, on top of pthreads.
+//
+//  (C) 2022 Thibaut VARENE
+//  License: GPLv2 - http://www.gnu.org/licenses/gpl-2.0.html
+//
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#define DEFAULT_PRIO	5	///< priority of the threads not created by xTaskCreate(), e.g. main()
+
+/** Task, priorities are only recorded */
+struct task {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t notify;	///< notification count
+	UBaseType_t prio;
+	TaskFunction_t fn;
+	void *arg;
+};
+
+/** Queue of fixed size items */
+struct queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	UBaseType_t length, size;
+	UBaseType_t head, count;
+	char *items;
+};
+
+/** Semaphore, mutexes are binary semaphores given at creation */
+struct sem {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	UBaseType_t count, max;
+};
+
+static __thread struct task *self;
+
+static struct task *task_new(UBaseType_t prio)
+{
+	struct task *t = calloc(1, sizeof(*t));
+
+	if (!t)
+		abort();
+
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->cond, NULL);
+	t->prio = prio;
+
+	return t;
+}
+
+static struct task *task_self(void)
+{
+	if (!self)
+		self = task_new(DEFAULT_PRIO);
+
+	return self;
+}
+
+/**
+ * Compute a condition variable deadline.
+ * @param ts the deadline
+ * @param ticks the timeout (ms)
+ */
+static void deadline(struct timespec *ts, TickType_t ticks)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += ticks / 1000;
+	ts->tv_nsec += (ticks % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/**
+ * Wait on a condition variable.
+ * @param cond the condition variable
+ * @param lock the held mutex
+ * @param ts the deadline, NULL to wait forever
+ * @return false on timeout
+ */
+static bool wait(pthread_cond_t *cond, pthread_mutex_t *lock, const struct timespec *ts)
+{
+	if (!ts)
+		return !pthread_cond_wait(cond, lock);
+
+	return pthread_cond_timedwait(cond, lock, ts) != ETIMEDOUT;
+}
+
+static void *task_main(void *arg)
+{
+	struct task *t = arg;
+
+	self = t;
+	t->fn(t->arg);
+
+	return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *task)
+{
+	struct task *t = task_new(prio);
+	pthread_t thread;
+
+	t->fn = fn;
+	t->arg = arg;
+
+	if (pthread_create(&thread, NULL, task_main, t)) {
+		free(t);
+		return pdFALSE;
+	}
+	pthread_detach(thread);
+
+	if (task)
+		*task = t;
+
+	return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio,
+				   TaskHandle_t *task, BaseType_t core)
+{
+	return xTaskCreate(fn, name, stack, arg, prio, task);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+	// only self deletion is used; the task struct is leaked, as a handle may still be notified
+	if (!task || task == self)
+		pthread_exit(NULL);
+	abort();
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+	usleep(ticks * 1000);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+	return task_self();
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task)
+{
+	return task ? ((struct task *)task)->prio : task_self()->prio;
+}
+
+void vTaskPrioritySet(TaskHandle_t task, UBaseType_t prio)
+{
+	(task ? (struct task *)task : task_self())->prio = prio;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+	struct task *t = task_self();
+	struct timespec ts;
+	uint32_t count;
+
+	if (ticks != portMAX_DELAY)
+		deadline(&ts, ticks);
+
+	pthread_mutex_lock(&t->lock);
+	while (!t->notify && ticks && wait(&t->cond, &t->lock, (ticks != portMAX_DELAY) ? &ts : NULL))
+		;
+	count = t->notify;
+	if (count)
+		t->notify = clear ? 0 : count - 1;
+	pthread_mutex_unlock(&t->lock);
+
+	return count;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+	struct task *t = task;
+
+	pthread_mutex_lock(&t->lock);
+	t->notify++;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+
+	return pdPASS;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t size)
+{
+	struct queue *q = calloc(1, sizeof(*q));
+
+	if (!q)
+		return NULL;
+
+	q->items = malloc(length * size);
+	if (!q->items) {
+		free(q);
+		return NULL;
+	}
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	q->length = length;
+	q->size = size;
+
+	return q;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+	struct queue *q = queue;
+	struct timespec ts;
+	BaseType_t ret = pdFALSE;
+
+	if (ticks != portMAX_DELAY)
+		deadline(&ts, ticks);
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count == q->length && ticks && wait(&q->cond, &q->lock, (ticks != portMAX_DELAY) ? &ts : NULL))
+		;
+	if (q->count < q->length) {
+		memcpy(q->items + ((q->head + q->count) % q->length) * q->size, item, q->size);
+		q->count++;
+		pthread_cond_broadcast(&q->cond);
+		ret = pdTRUE;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return ret;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+	struct queue *q = queue;
+	struct timespec ts;
+	BaseType_t ret = pdFALSE;
+
+	if (ticks != portMAX_DELAY)
+		deadline(&ts, ticks);
+
+	pthread_mutex_lock(&q->lock);
+	while (!q->count && ticks && wait(&q->cond, &q->lock, (ticks != portMAX_DELAY) ? &ts : NULL))
+		;
+	if (q->count) {
+		memcpy(item, q->items + q->head * q->size, q->size);
+		q->head = (q->head + 1) % q->length;
+		q->count--;
+		pthread_cond_broadcast(&q->cond);
+		ret = pdTRUE;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return ret;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+	struct queue *q = queue;
+
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+	free(q->items);
+	free(q);
+}
+
+static SemaphoreHandle_t sem_new(UBaseType_t max, UBaseType_t count)
+{
+	struct sem *s = calloc(1, sizeof(*s));
+
+	if (!s)
+		return NULL;
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	s->max = max;
+	s->count = count;
+
+	return s;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+	return sem_new(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+	return sem_new(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t count)
+{
+	return sem_new(max, count);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+	struct sem *s = sem;
+	struct timespec ts;
+	BaseType_t ret = pdFALSE;
+
+	if (ticks != portMAX_DELAY)
+		deadline(&ts, ticks);
+
+	pthread_mutex_lock(&s->lock);
+	while (!s->count && ticks && wait(&s->cond, &s->lock, (ticks != portMAX_DELAY) ? &ts : NULL))
+		;
+	if (s->count) {
+		s->count--;
+		ret = pdTRUE;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return ret;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+	struct sem *s = sem;
+	BaseType_t ret = pdFALSE;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->count < s->max) {
+		s->count++;
+		pthread_cond_broadcast(&s->cond);
+		ret = pdTRUE;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return ret;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+	struct sem *s = sem;
+
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
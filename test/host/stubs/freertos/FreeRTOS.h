@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdkconfig.h"	// as in ESP-IDF
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE			0
+#define pdTRUE			1
+#define pdPASS			pdTRUE
+#define portMAX_DELAY		((TickType_t)0xffffffff)
+#define portTICK_PERIOD_MS	1
+#define pdMS_TO_TICKS(ms)	((TickType_t)(ms))
+#define configMAX_PRIORITIES	25
+#define tskNO_AFFINITY		0x7fffffff
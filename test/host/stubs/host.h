@@ -0,0 +1,51 @@
+//
+//  host.h
+//
+//  Host build: controls of the stub layer, for the benchmark driver.
+//
+//  (C) 2022 Thibaut VARENE
+//  License: GPLv2 - http://www.gnu.org/licenses/gpl-2.0.html
+//
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_partition.h"
+
+/** Flash latency model and counters, see esp_partition_erase_range() and friends */
+struct host_flash {
+	int64_t erase_us;	///< time to erase a sector
+	int64_t write_us;	///< setup time of a write call
+	int64_t write_ns;	///< time to write a byte
+	int64_t read_ns;	///< time to read a byte, including when the image is verified
+	unsigned erases;	///< sectors erased
+	unsigned writes;	///< write calls
+	unsigned errors;	///< writes to bits which were not erased
+	int64_t busy_us;	///< total modelled flash time
+};
+
+extern struct host_flash host_flash;
+
+/**
+ * Set the amounts of data returned by receive calls.
+ * @param spec comma separated list of sizes, each either N or MIN-MAX (uniformly distributed),
+ * optionally followed by xCOUNT to repeat it; or "@file" to read such a list from a file (e.g. a recorded trace),
+ * where entries may also be separated by whitespace. The list is replayed in a loop.
+ * @return 0 on success, -1 on parse error
+ */
+int host_set_chunks(const char *spec);
+
+/**
+ * Restart the receive size list.
+ * @param seed seed for the MIN-MAX entries
+ */
+void host_reset_chunks(unsigned seed);
+
+/** @return the update partition, whose contents are in host_flash_data() */
+const esp_partition_t *host_update_partition(void);
+
+/**
+ * @param part a partition
+ * @return the current contents of part
+ */
+const uint8_t *host_flash_data(const esp_partition_t *part);
@@ -0,0 +1,370 @@
+//
+//  lwip.c
+//
+//  Host build: lwIP stubs. Sockets are the host ones, with the amount of data returned by the receive calls
+//  set by host_set_chunks(); netconn is emulated on top of them.
+//
+//  (C) 2022 Thibaut VARENE
+//  License: GPLv2 - http://www.gnu.org/licenses/gpl-2.0.html
+//
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwip/api.h"
+#include "lwip/sockets.h"
+#include "lwip/tcpip.h"
+#include "host.h"
+
+#undef recv
+
+#define NETBUF_SEG	1460	///< netbuf segment size, a TCP MSS
+#define NETBUF_MAX	65535	///< maximum netbuf size (u16_t lengths)
+#define CHUNK_WAIT	1000	///< how long (us) host_recv() waits for more data to fill the current chunk
+
+/** Receive size list entry */
+struct chunk {
+	int min, max;
+};
+
+const ip_addr_t ip_addr_any;
+
+static struct chunk *chunks;
+static int nchunks;
+static int chunk_idx;
+static int chunk_cur;		///< current receive size, 0 to draw the next one
+static unsigned chunk_seed;
+
+/**
+ * Append entries to the receive size list.
+ * @param s the entry, see host_set_chunks()
+ * @return 0 on success, -1 on parse error
+ */
+static int chunk_add(const char *s)
+{
+	struct chunk c, *n;
+	long count = 1;
+	char *end;
+
+	c.min = c.max = strtol(s, &end, 10);
+	if (end == s)
+		return -1;
+	if (*end == '-') {
+		s = end + 1;
+		c.max = strtol(s, &end, 10);
+		if (end == s)
+			return -1;
+	}
+	if (*end == 'x') {
+		s = end + 1;
+		count = strtol(s, &end, 10);
+		if (end == s)
+			return -1;
+	}
+	if (*end || c.min <= 0 || c.max < c.min || count <= 0)
+		return -1;
+
+	n = realloc(chunks, (nchunks + count) * sizeof(*chunks));
+	if (!n)
+		return -1;
+	chunks = n;
+	while (count--)
+		chunks[nchunks++] = c;
+
+	return 0;
+}
+
+int host_set_chunks(const char *spec)
+{
+	char *list, *tok, *save;
+	int ret = 0;
+
+	free(chunks);
+	chunks = NULL;
+	nchunks = 0;
+
+	if (*spec == '@') {
+		FILE *f = fopen(spec + 1, "r");
+		long len;
+
+		if (!f)
+			return -1;
+		fseek(f, 0, SEEK_END);
+		len = ftell(f);
+		rewind(f);
+		list = calloc(1, len + 1);
+		if (list && fread(list, 1, len, f) != (size_t)len) {
+			free(list);
+			list = NULL;
+		}
+		fclose(f);
+	}
+	else
+		list = strdup(spec);
+	if (!list)
+		return -1;
+
+	for (tok = strtok_r(list, ", \t\r\n", &save); tok && !ret; tok = strtok_r(NULL, ", \t\r\n", &save))
+		ret = chunk_add(tok);
+	free(list);
+
+	if (!nchunks)
+		ret = -1;
+
+	host_reset_chunks(chunk_seed);
+
+	return ret;
+}
+
+void host_reset_chunks(unsigned seed)
+{
+	chunk_seed = seed;
+	chunk_idx = 0;
+	chunk_cur = 0;
+}
+
+/**
+ * @return the amount of data the next receive call may return
+ */
+static int chunk_size(void)
+{
+	const struct chunk *c;
+
+	if (!nchunks)
+		return NETBUF_MAX;
+
+	if (!chunk_cur) {
+		c = &chunks[chunk_idx];
+		chunk_idx = (chunk_idx + 1) % nchunks;
+		chunk_cur = c->min + ((c->max > c->min) ? rand_r(&chunk_seed) % (c->max - c->min + 1) : 0);
+	}
+
+	return chunk_cur;
+}
+
+ssize_t host_recv(int sock, void *buf, size_t len, int flags)
+{
+	struct timeval tv;
+	size_t n = chunk_size();
+	ssize_t ret, more;
+	fd_set rfds;
+
+	if (len > n)
+		len = n;
+
+	ret = recv(sock, buf, len, flags);
+
+	// gather the rest of the chunk as long as it keeps coming: it models what the network stack would have buffered
+	while (ret > 0 && (size_t)ret < len) {
+		tv.tv_sec = 0;
+		tv.tv_usec = CHUNK_WAIT;
+		FD_ZERO(&rfds);
+		FD_SET(sock, &rfds);
+		if (select(sock + 1, &rfds, NULL, NULL, &tv) <= 0)
+			break;
+		more = recv(sock, (char *)buf + ret, len - ret, MSG_DONTWAIT);
+		if (more <= 0)
+			break;
+		ret += more;
+	}
+
+	if (ret > 0)
+		chunk_cur = 0;
+
+	return ret;
+}
+
+static struct netconn *netconn_alloc(int fd)
+{
+	struct netconn *conn;
+
+	if (fd < 0)
+		return NULL;
+
+	conn = calloc(1, sizeof(*conn));
+	if (conn)
+		conn->pcb.tcp = calloc(1, sizeof(*conn->pcb.tcp));
+	if (!conn || !conn->pcb.tcp) {
+		free(conn);
+		close(fd);
+		return NULL;
+	}
+	conn->pcb.tcp->fd = fd;
+
+	return conn;
+}
+
+/**
+ * Wait for a connection to become readable, according to its settings.
+ * @param conn the connection
+ * @return ERR_OK, ERR_WOULDBLOCK or ERR_TIMEOUT
+ */
+static err_t netconn_wait(struct netconn *conn)
+{
+	struct timeval tv = { .tv_sec = conn->recv_timeout / 1000, .tv_usec = (conn->recv_timeout % 1000) * 1000 };
+	int fd = conn->pcb.tcp->fd;
+	fd_set rfds;
+
+	if (!conn->nonblock && !conn->recv_timeout)
+		return ERR_OK;
+
+	if (conn->nonblock)
+		tv.tv_sec = tv.tv_usec = 0;
+
+	FD_ZERO(&rfds);
+	FD_SET(fd, &rfds);
+	if (select(fd + 1, &rfds, NULL, NULL, &tv) > 0)
+		return ERR_OK;
+
+	return conn->nonblock ? ERR_WOULDBLOCK : ERR_TIMEOUT;
+}
+
+struct netconn *netconn_new(int type)
+{
+	return netconn_alloc(socket(AF_INET, SOCK_STREAM, 0));
+}
+
+err_t netconn_bind(struct netconn *conn, const ip_addr_t *addr, u16_t port)
+{
+	struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = addr->addr };
+	int fd = conn->pcb.tcp->fd;
+
+	if (conn->pcb.tcp->so_options & SOF_REUSEADDR)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
+
+	return bind(fd, (struct sockaddr *)&sa, sizeof(sa)) ? ERR_VAL : ERR_OK;
+}
+
+err_t netconn_listen_with_backlog(struct netconn *conn, u8_t backlog)
+{
+	return listen(conn->pcb.tcp->fd, backlog) ? ERR_VAL : ERR_OK;
+}
+
+err_t netconn_accept(struct netconn *conn, struct netconn **new_conn)
+{
+	err_t err;
+
+	err = netconn_wait(conn);
+	if (err != ERR_OK)
+		return err;
+
+	*new_conn = netconn_alloc(accept(conn->pcb.tcp->fd, NULL, NULL));
+
+	return *new_conn ? ERR_OK : ERR_CONN;
+}
+
+err_t netconn_recv(struct netconn *conn, struct netbuf **new_buf)
+{
+	struct netbuf *buf;
+	err_t err;
+	int n;
+
+	*new_buf = NULL;
+
+	err = netconn_wait(conn);
+	if (err != ERR_OK)
+		return err;
+
+	buf = calloc(1, sizeof(*buf));
+	if (!buf)
+		return ERR_CONN;
+	buf->data = malloc(NETBUF_MAX);
+	if (!buf->data) {
+		free(buf);
+		return ERR_CONN;
+	}
+
+	n = host_recv(conn->pcb.tcp->fd, buf->data, NETBUF_MAX, 0);
+	if (n <= 0) {
+		netbuf_delete(buf);
+		return n ? ERR_CONN : ERR_CLSD;
+	}
+	buf->len = n;
+	*new_buf = buf;
+
+	return ERR_OK;
+}
+
+err_t netconn_write(struct netconn *conn, const void *data, size_t size, u8_t flags)
+{
+	const char *p = data;
+	ssize_t n;
+
+	// as lwIP does without bytes_written
+	if (conn->nonblock)
+		return ERR_VAL;
+
+	while (size) {
+		n = send(conn->pcb.tcp->fd, p, size, MSG_NOSIGNAL);
+		if (n < 0)
+			return ERR_CONN;
+		p += n;
+		size -= n;
+	}
+
+	return ERR_OK;
+}
+
+err_t netconn_close(struct netconn *conn)
+{
+	shutdown(conn->pcb.tcp->fd, SHUT_RDWR);
+
+	return ERR_OK;
+}
+
+err_t netconn_delete(struct netconn *conn)
+{
+	close(conn->pcb.tcp->fd);
+	free(conn->pcb.tcp);
+	free(conn);
+
+	return ERR_OK;
+}
+
+err_t netbuf_data(struct netbuf *buf, void **data, u16_t *len)
+{
+	int n = buf->len - buf->off;
+
+	*data = buf->data + buf->off;
+	*len = (n > NETBUF_SEG) ? NETBUF_SEG : n;
+
+	return ERR_OK;
+}
+
+int8_t netbuf_next(struct netbuf *buf)
+{
+	if (buf->len - buf->off <= NETBUF_SEG)
+		return -1;
+
+	buf->off += NETBUF_SEG;
+
+	return (buf->len - buf->off <= NETBUF_SEG) ? 1 : 0;
+}
+
+void netbuf_delete(struct netbuf *buf)
+{
+	free(buf->data);
+	free(buf);
+}
+
+int ipaddr_aton(const char *cp, ip_addr_t *addr)
+{
+	struct in_addr in;
+
+	if (!inet_aton(cp, &in))
+		return 0;
+	addr->addr = in.s_addr;
+
+	return 1;
+}
+
+err_t tcpip_api_call(tcpip_api_call_fn fn, struct tcpip_api_call_data *call)
+{
+	// there is no lwIP thread
+	call->err = fn(call);
+
+	return call->err;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef int8_t err_t;
+typedef uint8_t u8_t;
+typedef uint16_t u16_t;
+typedef uint32_t u32_t;
+
+#define ERR_OK		0
+#define ERR_TIMEOUT	-3
+#define ERR_VAL		-6
+#define ERR_WOULDBLOCK	-7
+#define ERR_CONN	-11
+#define ERR_CLSD	-15
+
+#define SO_REUSE		1
+#define LWIP_SO_RCVBUF		1
+#define LWIP_TCP_KEEPALIVE	1
+#define SOF_REUSEADDR		0x04
+#define SOF_KEEPALIVE		0x08
+
+#define NETCONN_TCP	0x10
+#define NETCONN_COPY	0x01
+
+typedef struct {
+	u32_t addr;
+} ip_addr_t;
+
+extern const ip_addr_t ip_addr_any;
+#define IP_ADDR_ANY	(&ip_addr_any)
+
+/** TCP options, only recorded */
+struct tcp_pcb {
+	int fd;			///< host socket
+	u8_t so_options;
+	u32_t keep_idle, keep_intvl, keep_cnt;
+	bool nagle_off;
+};
+
+/** Connection emulated over a host socket */
+struct netconn {
+	union {
+		struct tcp_pcb *tcp;
+	} pcb;
+	int recv_timeout;	///< ms, 0 for none
+	bool nonblock;
+};
+
+/** Received data, split into segments of at most a TCP MSS */
+struct netbuf {
+	char *data;
+	int len;		///< total amount of data
+	int off;		///< offset of the current segment
+};
+
+struct netconn *netconn_new(int type);
+err_t netconn_bind(struct netconn *conn, const ip_addr_t *addr, u16_t port);
+err_t netconn_listen_with_backlog(struct netconn *conn, u8_t backlog);
+err_t netconn_accept(struct netconn *conn, struct netconn **new_conn);
+err_t netconn_recv(struct netconn *conn, struct netbuf **new_buf);
+err_t netconn_write(struct netconn *conn, const void *data, size_t size, u8_t flags);
+err_t netconn_close(struct netconn *conn);
+err_t netconn_delete(struct netconn *conn);
+
+#define netconn_set_recvtimeout(conn, ms)	((conn)->recv_timeout = (ms))
+#define netconn_set_nonblocking(conn, val)	((conn)->nonblock = (val))
+#define netconn_set_recvbufsize(conn, size)	((void)(conn), (void)(size))
+
+err_t netbuf_data(struct netbuf *buf, void **data, u16_t *len);
+int8_t netbuf_next(struct netbuf *buf);
+void netbuf_delete(struct netbuf *buf);
+
+int ipaddr_aton(const char *cp, ip_addr_t *addr);
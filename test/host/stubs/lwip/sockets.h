@@ -0,0 +1,15 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/** recv() returning the amounts of data set with host_set_chunks() */
+ssize_t host_recv(int sock, void *buf, size_t len, int flags);
+
+#define recv(sock, buf, len, flags)	host_recv(sock, buf, len, flags)
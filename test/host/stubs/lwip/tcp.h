@@ -0,0 +1,6 @@
+#pragma once
+
+#include "lwip/api.h"
+
+#define ip_set_option(pcb, opt)	((pcb)->so_options |= (opt))
+#define tcp_nagle_disable(pcb)	((pcb)->nagle_off = true)
@@ -0,0 +1,69 @@
+//
+//  sdkconfig.h
+//
+//  Host build configuration: the menuconfig defaults, except where noted.
+//  Feature options are set per target, see ../CMakeLists.txt.
+//
+//  (C) 2022 Thibaut VARENE
+//  License: GPLv2 - http://www.gnu.org/licenses/gpl-2.0.html
+//
+
+#pragma once
+
+#define CONFIG_SIMPLE_PUSHOTA_ENABLED 1
+#define CONFIG_SIMPLE_PUSHOTA_PORT 8888
+#define CONFIG_SIMPLE_PUSHOTA_BIND_ADDR "127.0.0.1"	// not exposed on the build machine
+#define CONFIG_SIMPLE_PUSHOTA_BACKLOG 1
+#define CONFIG_SIMPLE_PUSHOTA_RCVBUF 0
+#define CONFIG_SIMPLE_PUSHOTA_RCV_TIMEOUT 0
+#define CONFIG_SIMPLE_PUSHOTA_KEEPALIVE_IDLE 5
+#define CONFIG_SIMPLE_PUSHOTA_KEEPALIVE_INTERVAL 5
+#define CONFIG_SIMPLE_PUSHOTA_KEEPALIVE_COUNT 3
+#define CONFIG_SIMPLE_PUSHOTA_BOOST_PRIO 0
+#define CONFIG_SIMPLE_PUSHOTA_PIPELINE_NBUFS 2
+#define CONFIG_SIMPLE_PUSHOTA_PIPELINE_STACK 2048
+#define CONFIG_SIMPLE_PUSHOTA_PIPELINE_WRITER_PRIO 0
+
+// Kconfig selects
+#if defined(CONFIG_SIMPLE_PUSHOTA_SKIP_UNCHANGED) && !defined(CONFIG_SIMPLE_PUSHOTA_COALESCE)
+ #define CONFIG_SIMPLE_PUSHOTA_COALESCE 1
+#endif
+#if defined(CONFIG_SIMPLE_PUSHOTA_MULTICAST) || defined(CONFIG_SIMPLE_PUSHOTA_PARALLEL) || defined(CONFIG_SIMPLE_PUSHOTA_BG_ERASE) \
+    || defined(CONFIG_SIMPLE_PUSHOTA_SKIP_UNCHANGED) || defined(CONFIG_SIMPLE_PUSHOTA_RESUME) || defined(CONFIG_SIMPLE_PUSHOTA_SKIP_VERIFY)
+ #define CONFIG_SIMPLE_PUSHOTA_PARTWRITE 1
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_PARALLEL
+ #define CONFIG_SIMPLE_PUSHOTA_PARALLEL_CONNS 4
+ #define CONFIG_SIMPLE_PUSHOTA_PARALLEL_STACK 4096
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_FANOUT
+ #define CONFIG_SIMPLE_PUSHOTA_FANOUT_TIMEOUT 60
+#endif
+
+#ifdef CONFIG_SIMPLE_PUSHOTA_THROTTLE
+ #ifndef CONFIG_SIMPLE_PUSHOTA_THROTTLE_RATE
+  #define CONFIG_SIMPLE_PUSHOTA_THROTTLE_RATE 0
+ #endif
+ #ifndef CONFIG_SIMPLE_PUSHOTA_THROTTLE_WINDOW
+  #define CONFIG_SIMPLE_PUSHOTA_THROTTLE_WINDOW 100
+ #endif
+ #ifndef CONFIG_SIMPLE_PUSHOTA_THROTTLE_FLASH_MS
+  #define CONFIG_SIMPLE_PUSHOTA_THROTTLE_FLASH_MS 0
+ #endif
+#endif
+
+#if !defined(CONFIG_SIMPLE_PUSHOTA_BUF_HEAP) && !defined(CONFIG_SIMPLE_PUSHOTA_BUF_PSRAM)
+ #define CONFIG_SIMPLE_PUSHOTA_BUF_STACK 1
+#endif
+
+#ifndef CONFIG_SIMPLE_PUSHOTA_BUFSIZE
+ #if defined(CONFIG_SIMPLE_PUSHOTA_BUF_STACK) && !defined(CONFIG_SIMPLE_PUSHOTA_COALESCE)
+  #define CONFIG_SIMPLE_PUSHOTA_BUFSIZE 1024
+ #else
+  #define CONFIG_SIMPLE_PUSHOTA_BUFSIZE 4096
+ #endif
+#endif
+
+#define CONFIG_LWIP_SO_REUSE 1		// as in the ESP-IDF defaults
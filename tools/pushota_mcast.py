@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+#
+#  pushota_mcast.py
+#
+#
+#  (C) 2022 Thibaut VARENE
+#  License: GPLv2 - http://www.gnu.org/licenses/gpl-2.0.html
+#
+
+"""
+Multicast push OTA sender, see CONFIG_SIMPLE_PUSHOTA_MULTICAST.
+
+Sends a firmware image to all devices running pushota_multicast() at once:
+the image is sent block by block to the multicast group, then the receivers are
+polled for missing blocks, which are sent again until no receiver reports any.
+"""
+
+import argparse
+import random
+import socket
+import struct
+import sys
+import time
+
+MAGIC = 0x504f5441	# "POTA"
+HDR = struct.Struct('!IBBHIII')	# magic, type, reserved, blksize, session, size, arg
+DATA, POLL, NACK = range(3)
+
+
+def main():
+	ap = argparse.ArgumentParser(description='Multicast push OTA sender')
+	ap.add_argument('image', help='firmware image, e.g. build/<project>.bin')
+	ap.add_argument('-g', '--group', default='239.255.80.79', help='multicast group (default: %(default)s)')
+	ap.add_argument('-p', '--port', type=int, default=8888, help='UDP port (default: %(default)s)')
+	ap.add_argument('-i', '--iface', default='0.0.0.0', help='local address of the outgoing interface')
+	ap.add_argument('-t', '--ttl', type=int, default=1, help='multicast TTL (default: %(default)s)')
+	ap.add_argument('-b', '--blksize', type=int, default=1024, help='block size (default: %(default)s)')
+	ap.add_argument('-r', '--rate', type=int, default=200, help='max send rate in KB/s (default: %(default)s)')
+	ap.add_argument('-w', '--wait', type=float, default=0.5, help='time (s) to collect NACKs after each poll (default: %(default)s)')
+	ap.add_argument('-q', '--quiet', type=int, default=3, help='stop after this many polls without NACK (default: %(default)s)')
+	args = ap.parse_args()
+
+	if args.blksize <= 0 or args.blksize % 16:
+		sys.exit('block size must be a positive multiple of 16')
+
+	data = open(args.image, 'rb').read()
+	nblocks = (len(data) + args.blksize - 1) // args.blksize
+	session = random.getrandbits(32)
+
+	sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+	sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, args.ttl)
+	sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton(args.iface))
+	sock.bind((args.iface, 0))
+	dest = (args.group, args.port)
+
+	def send(ptype, arg, payload=b''):
+		sock.sendto(HDR.pack(MAGIC, ptype, 0, args.blksize, session, len(data), arg) + payload, dest)
+
+	print('Session %#x: %d bytes, %d blocks of %d bytes' % (session, len(data), nblocks, args.blksize))
+
+	pending = set(range(nblocks))
+	delay = args.blksize / (args.rate * 1024.0)
+	quiet = sent = 0
+	start = time.time()
+
+	while quiet < args.quiet:
+		nxt = time.time()
+		for n in sorted(pending):
+			send(DATA, n, data[n * args.blksize:(n + 1) * args.blksize])
+			sent += 1
+			nxt += delay
+			pause = nxt - time.time()
+			if pause > 0:
+				time.sleep(pause)
+		pending = set()
+
+		send(POLL, nblocks)
+		nacks = 0
+		end = time.time() + args.wait
+		while True:
+			sock.settimeout(max(end - time.time(), 0.001))
+			try:
+				pkt, _ = sock.recvfrom(2048)
+			except socket.timeout:
+				break
+			if len(pkt) < HDR.size:
+				continue
+			magic, ptype, _, _, sess, _, count = HDR.unpack_from(pkt)
+			if magic != MAGIC or ptype != NACK or sess != session:
+				continue
+			nacks += 1
+			for i in range(min(count, (len(pkt) - HDR.size) // 8)):
+				first, cnt = struct.unpack_from('!II', pkt, HDR.size + i * 8)
+				pending.update(range(first, min(first + cnt, nblocks)))
+
+		quiet = 0 if pending else quiet + 1
+		if pending:
+			print('%d NACKs, resending %d blocks' % (nacks, len(pending)))
+
+	elapsed = time.time() - start
+	print('Done: %d blocks sent (%.1f%% overhead) in %.1f s' % (sent, 100.0 * (sent - nblocks) / nblocks, elapsed))
+
+
+if __name__ == '__main__':
+	main()